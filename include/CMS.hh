@@ -21,6 +21,10 @@
 #include <istream>
 #include <ostream>
 #include <memory>
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
 #include <boost/filesystem.hpp>
 #include <lcms2.h>
 #include <lcms2_plugin.h>
@@ -75,9 +79,17 @@ namespace CMS {
   class Profile {
   private:
     cmsHPROFILE _profile;
+    std::string _hash;
 
     //! Private constructor for use by named constructors
-    inline Profile(cmsHPROFILE p) { _profile = p; }
+    inline Profile(cmsHPROFILE p) : _profile(p) { _set_hash(); }
+
+    //! Private method for storing the profile ID, computing it if the header has none or it is out of date
+    /*!
+      Called whenever the profile is made or changed, so that hash() never
+      has to write to the header while other threads use the profile.
+    */
+    void _set_hash(bool recompute = false);
 
     //! Private method for writing a string tag
     void write_MLU(cmsTagSignature sig, std::string language, std::string country, std::string text);
@@ -108,6 +120,7 @@ namespace CMS {
       if (!cmsWriteTag(_profile, sig, (void*)data))
 	throw PhotoFinish::LibraryError("LCMS2", "Could not find tag " + (char)(sig >> 24) + (char)(sig >> 16) + (char)(sig >> 8) + (char)sig);
 
+      _set_hash(true);
       return *this;
     }
 
@@ -141,15 +154,18 @@ namespace CMS {
     //! Shared pointer typedef
     typedef std::shared_ptr<Profile> ptr;
 
-    //! Named constructor
+    //! Named constructor, the same object is returned every time
     static ptr Lab4(void);
       
-    //! Named constructor
+    //! Named constructor, the same object is returned every time
     static ptr sRGB(void);
       
-    //! Named constructor
+    //! Named constructor, the same object is returned every time
     static ptr sGrey(void);
 
+    //! The profile ID (MD5) in hex, from the header or computed when the profile was made
+    inline std::string hash(void) const { return _hash; }
+
     //! Set the description tag
     void set_description(std::string language, std::string country, std::string text);
     //! Set the description tag with a wide string
@@ -502,6 +518,16 @@ inline T read_##N(void) { return _read_tag<cms##T>(S); }
     //! Private constructor
     Transform(cmsHTRANSFORM t);
 
+    typedef std::list<std::pair<std::string, std::shared_ptr<Transform> > > cache_list;
+    static cache_list _cache;		// Most recently used first
+    static std::mutex _cache_lock;
+    static std::atomic<unsigned long int> _cache_hits, _cache_misses, _disk_hits;
+
+    //! Build a transform, or load it from a device link in disk_cache_dir
+    static std::shared_ptr<Transform> _build(Profile::ptr input, const Format &informat,
+					     Profile::ptr output, const Format &outformat,
+					     Intent intent, cmsUInt32Number flags, const std::string& key);
+
     // To allow the static constructors (and anyone else?!?) to use make_shared on the private constructor
     friend class __gnu_cxx::new_allocator<Transform>;
 
@@ -511,6 +537,10 @@ inline T read_##N(void) { return _read_tag<cms##T>(S); }
 	      Profile::ptr output, const Format &outformat,
 	      Intent intent, cmsUInt32Number flags);
 
+    //! Construct a transform from a device link profile
+    Transform(Profile::ptr link, const Format &informat, const Format &outformat,
+	      Intent intent, cmsUInt32Number flags);
+
     //! Construct a transform from multiple profiles
     Transform(std::vector<Profile::ptr> profile,
 	      const Format &informat, const Format &outformat,
@@ -521,6 +551,36 @@ inline T read_##N(void) { return _read_tag<cms##T>(S); }
 
     typedef std::shared_ptr<Transform> ptr;
 
+    //! Maximum number of transforms kept by create()
+    static unsigned int cache_size;
+
+    //! Directory of device links of previously built transforms, not used if empty (the default)
+    static fs::path disk_cache_dir;
+
+    //! Named constructor that reuses transforms
+    /*!
+      Transforms are looked up by the MD5 of each profile, the formats, intent
+      and flags, and the most recently used cache_size of them are kept. The
+      same transform may be used by several images and threads at once, so
+      'flags' should include cmsFLAGS_NOCACHE and its formats must not be changed.
+
+      With disk_cache_dir set, transforms between integer formats that are not
+      kept are loaded from a device link saved there by an earlier run, or
+      saved there once built. Floating-point transforms are always built.
+    */
+    static ptr create(Profile::ptr input, const Format &informat,
+		      Profile::ptr output, const Format &outformat,
+		      Intent intent, cmsUInt32Number flags);
+
+    //! Number of transforms that were found in the cache
+    static unsigned long int cache_hits(void) { return _cache_hits; }
+
+    //! Number of transforms that had to be built
+    static unsigned long int cache_misses(void) { return _cache_misses; }
+
+    //! Number of transforms that were loaded from disk_cache_dir
+    static unsigned long int disk_hits(void) { return _disk_hits; }
+
     //! Named constructor for creating a proofing transform
     static ptr Proofing(Profile::ptr input, const Format &informat,
 			Profile::ptr output, const Format &outformat,
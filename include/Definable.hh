@@ -84,7 +84,7 @@ namespace PhotoFinish {
     /*!
       Outputs "[undefined]" if the value is not defined.
     */
-    inline friend std::ostream& operator << (std::ostream& out, definable<T>& data) {
+    inline friend std::ostream& operator << (std::ostream& out, const definable<T>& data) {
       if (data._defined)
 	out << data._item;
       else
@@ -44,6 +44,9 @@ namespace PhotoFinish {
   class D_sharpen : public Role_Definable {
   private:
     definable<double> _radius, _sigma;
+    std::string _method;
+    definable<double> _amount;
+    definable<bool> _luminance;
 
   public:
     //! Empty constructor
@@ -52,7 +55,19 @@ namespace PhotoFinish {
     inline definable<double> radius(void) const { return _radius; }
     inline definable<double> sigma(void) const { return _sigma; }
 
+    //! "unsharp" (the default) for a separable unsharp mask, "recursive" for one with a recursive blur, or "kernel" for the full 2D kernel
+    inline std::string method(void) const { return _method; }
+
+    //! Amount of (original - blurred) to add with the "unsharp" method, by default the same as the 2D kernel
+    inline definable<double> amount(void) const { return _amount; }
+
+    //! Sharpen only the lightness of Lab (or greyscale) images, copying the other channels
+    inline definable<bool> luminance(void) const { return _luminance; }
+
     void read_config(const YAML::Node& node);
+
+    //! Write out the parameters, e.g. to tell whether two destinations sharpen the same way
+    friend std::ostream& operator<< (std::ostream& out, const D_sharpen& ds);
   };
 
   //! Resize parameters for destination
@@ -60,6 +75,8 @@ namespace PhotoFinish {
   private:
     std::string _filter;
     definable<double> _support;
+    definable<bool> _integer;
+    definable<double> _prereduce;
 
     D_resize(const std::string& f, double s);
 
@@ -76,7 +93,19 @@ namespace PhotoFinish {
     inline std::string filter(void) const { return _filter; }
     inline definable<double> support(void) const { return _support; }
 
+    //! Resize 8 and 16-bit images with integer weights and sums
+    inline definable<bool> integer(void) const { return _integer; }
+    inline D_resize& set_integer(bool i = true) { _integer = i; return *this; }
+
+    //! Box-average by whole factors first, leaving at most this much reduction (at least 2) to the filter
+    inline definable<double> prereduce(void) const { return _prereduce; }
+    inline D_resize& set_prereduce(double p) { _prereduce = p; return *this; }
+    inline D_resize& clear_prereduce(void) { _prereduce.undefine(); return *this; }
+
     void read_config(const YAML::Node& node);
+
+    //! Write out the parameters, e.g. to tell whether two destinations resize the same way
+    friend std::ostream& operator<< (std::ostream& out, const D_resize& dr);
   };
 
   //! Target parameters for destination
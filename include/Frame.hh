@@ -19,10 +19,13 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include "Destination_items.hh"
 
 namespace PhotoFinish {
 
+  class Kernel2D;
+
   //! Crop+rescaling parameters
   class Frame : public D_target {
   private:
@@ -47,6 +50,8 @@ namespace PhotoFinish {
 
     //! Crop and resize an image
     /*!
+      Both directions are done in one pass, see Kernel1Dvar::convolve_hv().
+      If the D_resize object has a 'prereduce' tolerance, blocks of pixels are averaged first.
       \param img The source image
       \param dr A D_resize object which will supply our parameters.
       \param can_free Can each row of the image be freed after it is convolved?
@@ -54,6 +59,42 @@ namespace PhotoFinish {
     */
     Image::ptr crop_resize(Image::ptr img, const D_resize &dr, bool can_free = false);
 
+    //! Crop, resize and sharpen an image without keeping the whole resized image
+    /*!
+      Rows of the resized image are sharpened as soon as every row under the
+      sharpening kernel has been made, and freed once no longer needed.
+      Kernels that need the whole image are applied after the resize.
+      \param img The source image
+      \param dr A D_resize object which will supply our parameters.
+      \param sharpen The sharpening kernel
+      \param can_free Can each row of the image be freed after it is convolved?
+      \return A new cropped, resized and sharpened image
+    */
+    Image::ptr crop_resize_sharpen(Image::ptr img, const D_resize &dr, std::shared_ptr<Kernel2D> sharpen, bool can_free = false);
+
+    //! Crop and resize an image to several frames, reading the source once
+    /*!
+      The horizontal passes of all frames are done together as each source
+      row is read, then each frame's vertical pass. Resizes with integer
+      weights or a 'prereduce' tolerance are done one by one with crop_resize().
+      \param img The source image
+      \param frames The frames
+      \param resizes A D_resize object for each frame
+      \param can_free Can rows of the image be freed once every frame has used them?
+      \return A new cropped and resized image for each frame
+    */
+    static std::vector<Image::ptr> crop_resize_many(Image::ptr img, const std::vector<std::shared_ptr<Frame> >& frames, const std::vector<D_resize>& resizes, bool can_free = false);
+
+    //! Crop and resize an image, producing rows only as they are needed
+    /*!
+      Rows of the source image are freed once they have been used.
+      \param img The source image
+      \param dr A D_resize object which will supply our parameters.
+      \param can_free Can rows of the source image be freed once used? Rows of the intermediate image always are.
+      \return A new lazy image
+    */
+    Image::ptr crop_resize_lazy(Image::ptr img, const D_resize &dr, bool can_free = true);
+
     //! The left-most border of the crop window
     inline const double crop_x(void) const { return _crop_x; }
     //! The top-most border of the crop window
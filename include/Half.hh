@@ -0,0 +1,110 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace PhotoFinish {
+
+  //! A 16-bit half precision floating point value, only used for storage
+  /*!
+    Values are widened to float when read and narrowed (rounding to nearest
+    even) when assigned, so all arithmetic is done in single precision.
+   */
+  class half {
+  private:
+    uint16_t _bits;
+
+    static inline float _to_float(uint16_t h) {
+#ifdef __F16C__
+      return _cvtsh_ss(h);
+#else
+      uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+      uint32_t exp = (h >> 10) & 0x1f;
+      uint32_t mant = h & 0x3ff;
+      uint32_t bits;
+      if (exp == 0x1f)				// Infinity or NaN
+	bits = sign | 0x7f800000 | (mant << 13);
+      else if (exp > 0)				// Normal
+	bits = sign | ((exp + 112) << 23) | (mant << 13);
+      else if (mant == 0)			// Zero
+	bits = sign;
+      else {					// Subnormal, make it normal
+	exp = 113;
+	while ((mant & 0x400) == 0) {
+	  mant <<= 1;
+	  exp--;
+	}
+	bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+      }
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      return f;
+#endif
+    }
+
+    static inline uint16_t _from_float(float f) {
+#ifdef __F16C__
+      return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+      uint32_t bits;
+      memcpy(&bits, &f, sizeof(bits));
+      uint16_t sign = (bits >> 16) & 0x8000;
+      uint32_t abs = bits & 0x7fffffff;
+      if (abs >= 0x7f800000)			// Infinity or NaN
+	return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+      if (abs >= 0x477ff000)			// Too big, round to infinity
+	return sign | 0x7c00;
+      if (abs < 0x38800000) {			// Subnormal or zero
+	if (abs < 0x33000000)
+	  return sign;
+	uint32_t exp = abs >> 23;
+	uint32_t mant = (abs & 0x7fffff) | 0x800000;
+	uint32_t shift = 126 - exp;
+	uint32_t h = mant >> shift;
+	uint32_t rest = mant & ((1 << shift) - 1), halfway = 1 << (shift - 1);
+	if ((rest > halfway) || ((rest == halfway) && (h & 1)))
+	  h++;
+	return sign | h;
+      }
+      // Normal, round the mantissa to nearest even
+      abs += 0xfff + ((abs >> 13) & 1);
+      return sign | ((abs - 0x38000000) >> 13);
+#endif
+    }
+
+  public:
+    //! Empty constructor
+    half() {}
+
+    //! Narrow from a float
+    half(float f) :
+      _bits(_from_float(f))
+    {}
+
+    //! Widen to a float
+    inline operator float() const { return _to_float(_bits); }
+
+  }; // class half
+
+}; // namespace PhotoFinish
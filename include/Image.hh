@@ -20,23 +20,69 @@
 
 #include <memory>
 #include <vector>
+#include <mutex>
+#include <atomic>
 #include <exiv2/exiv2.hpp>
 #include "Definable.hh"
 #include "CMS.hh"
+#include "ImageSlab.hh"
+#include "RowBufferPool.hh"
+#include "Half.hh"
 #include "sample.h"
 
 namespace PhotoFinish {
 
+  class Image;
   class ImageRow;
 
+  //! Abstract base class for objects that produce the rows of an image on demand
+  class RowGenerator {
+  public:
+    //! Shared pointer for a RowGenerator
+    typedef std::shared_ptr<RowGenerator> ptr;
+
+    virtual ~RowGenerator() {}
+
+    //! Produce a range of rows of an image
+    /*!
+      Rows are always asked for in order, starting from the top.
+      \param dest The image whose rows are produced
+      \param first The first row to produce
+      \param last One past the last row to produce
+    */
+    virtual void generate(Image& dest, unsigned int first, unsigned int last) = 0;
+
+    //! The number of rows to produce at a time
+    static unsigned int block_rows(void);
+
+  }; // class RowGenerator
+
+  //! How intermediate (Lab) images are stored
+  enum class Precision {
+    Sample,	// SAMPLE, i.e. float or double
+    Half,	// 16-bit half precision float
+    Fixed16,	// 16-bit unsigned integer
+  };
+
+  //! Parse a precision name ("float", "half", or "16bit")
+  /*!
+    \return False if the name was not recognised
+  */
+  bool parse_precision(const std::string& name, Precision& precision);
+
   //! An image class
-  class Image {
+  class Image : public std::enable_shared_from_this<Image> {
   private:
     unsigned int _width, _height;
     CMS::Profile::ptr _profile;
     CMS::Format _format;
-    size_t _pixel_size, _plane_size, _row_size;
+    size_t _pixel_size, _plane_size, _row_size, _row_stride;
+    unsigned int _slab_rows;			// Number of rows stored in each slab
+    std::vector<ImageSlab::ptr> _slabs;
     std::vector<std::shared_ptr<ImageRow>> _rows;
+    RowGenerator::ptr _generator;
+    mutable std::mutex _generator_lock;
+    mutable std::atomic<unsigned int> _next_row;	// First row not yet produced by the generator
     definable<double> _xres, _yres;		// PPI
 
     Exiv2::ExifData _EXIFtags;
@@ -44,6 +90,16 @@ namespace PhotoFinish {
     Exiv2::XmpData _XMPtags;
 
     void _calc_sizes(void);
+    void _make_slabs(void);
+    std::shared_ptr<ImageRow> _new_row(unsigned int y);
+    void _generate(unsigned int y) const;
+    std::shared_ptr<Image> _transform_colour(CMS::Profile::ptr dest_profile, CMS::Format dest_format, CMS::Intent intent, bool can_free, bool lazy);
+
+    friend class ColourTransformer;
+
+    //! Transform a range of rows into another image
+    void _transform_rows(CMS::Transform::ptr transform, std::shared_ptr<Image> dest, unsigned int first, unsigned int last,
+			 bool need_un_alpha_mult, bool need_alpha_mult, CMS::Format orig_dest_format, bool can_free);
 
   public:
     //! Shared pointer for an Image
@@ -106,14 +162,56 @@ namespace PhotoFinish {
     //! Retun the size of a row in bytes
     inline size_t row_size(void) const { return _row_size; }
 
+    //! Retun the distance in bytes between the start of consecutive rows in a slab
+    inline size_t row_stride(void) const { return _row_stride; }
+
     inline void check_row_alloc(unsigned int y) {
       if (!_rows[y])
-	_rows[y] = std::make_shared<ImageRow>(this, y);
+	_rows[y] = _new_row(y);
+    }
+
+
+    //! Pointer to the pixel data of row 'y' for filling in, allocating it if needed
+    template <typename T = unsigned char>
+    inline T* write_row_data(unsigned int y);
+
+    //! Produce this image's rows on demand from a generator, as they are asked for
+    void set_generator(RowGenerator::ptr gen);
+
+    //! Are some rows of this image still to be produced by a generator?
+    inline bool is_lazy(void) const { return _next_row.load(std::memory_order_acquire) < _height; }
+
+    //! Make sure that row 'y' (and every row before it) has been produced
+    /*!
+      The generator runs its own parallel loops while holding a lock, so this
+      (and row() or row_data(), which call it) must not have to produce rows
+      from inside a parallel region. The generation would run on one thread
+      while the others wait. Produce the whole range of rows that a parallel
+      loop will read before it starts instead.
+    */
+    inline void check_row_generated(unsigned int y) const {
+      if (y >= _next_row.load(std::memory_order_acquire))
+	_generate(y);
     }
 
+    //! Make sure that every row has been produced
+    inline void generate_all(void) const {
+      if (_height > 0)
+	check_row_generated(_height - 1);
+    }
 
-    //! Row holder at a y value
-    std::shared_ptr<ImageRow> row(unsigned int y) const { return _rows[y]; }
+    //! Row holder at a y value, produced first if needed (see check_row_generated())
+    std::shared_ptr<ImageRow> row(unsigned int y) const {
+      check_row_generated(y);
+      return _rows[y];
+    }
+
+    //! Pointer to the pixel data of row 'y', without touching the row's reference count
+    /*!
+      The row is produced first if needed, see check_row_generated().
+    */
+    template <typename T = unsigned char>
+    inline T* row_data(unsigned int y, unsigned int x = 0, unsigned int c = 0) const;
 
     //! Free the memory storing row 'y'
     inline void free_row(unsigned int y) {
@@ -137,6 +235,16 @@ namespace PhotoFinish {
 
     inline static CMS::Profile::ptr default_profile(CMS::Format format, std::string for_desc) { return default_profile(format.colour_model(), for_desc); }
 
+    //! Precision used to store intermediate images
+    /*!
+      The kernels and colour transforms widen values to SAMPLE when they read
+      them, so this only changes memory use and rounding between stages.
+    */
+    static Precision intermediate_precision;
+
+    //! The Lab format used for intermediate images
+    static CMS::Format intermediate_format(unsigned int extra_channels);
+
     //! Transform this image into a different colour space and/or ICC profile, making a new image
     /*!
       \param dest_profile The ICC profile of the destination. If empty, uses image's profile.
@@ -147,6 +255,17 @@ namespace PhotoFinish {
      */
     ptr transform_colour(CMS::Profile::ptr dest_profile, CMS::Format dest_format, CMS::Intent intent = CMS::Intent::Perceptual, bool can_free = false);
 
+    //! Transform this image into a different colour space and/or ICC profile, making a new lazy image
+    /*!
+      Rows of the new image are only transformed when they are asked for, and
+      rows of this image are freed as soon as they have been transformed.
+      \param dest_profile The ICC profile of the destination. If empty, uses image's profile.
+      \param dest_format The LCMS2 pixel format.
+      \param intent The ICC intent of the transform, defaults to perceptual.
+      \return A new image
+     */
+    ptr transform_colour_lazy(CMS::Profile::ptr dest_profile, CMS::Format dest_format, CMS::Intent intent = CMS::Intent::Perceptual);
+
   };
 
 
@@ -156,6 +275,8 @@ namespace PhotoFinish {
     const Image *_image;
     const unsigned int _y;
     unsigned char *_data;
+    ImageSlab::ptr _slab;		// Empty if the row owns its data
+    size_t _size;			// Size of the data
 
     friend class Image;
 
@@ -184,15 +305,35 @@ namespace PhotoFinish {
     typedef std::shared_ptr<ImageRow> ptr;
 
     //! Constructor
+    /*!
+      The row owns its own data, which comes from the RowBufferPool.
+    */
     ImageRow(const Image* img, unsigned int y) :
       _image(img),
       _y(y),
-      _data(new unsigned char[_image->row_size()])
+      _data(RowBufferPool::acquire(_image->row_size())),
+      _size(_image->row_size())
+    {}
+
+    //! Constructor
+    /*!
+      The row's data lives inside a slab owned by the image.
+      \param slab The slab holding this row
+      \param offset Offset in bytes of this row from the start of the slab
+    */
+    ImageRow(const Image* img, unsigned int y, ImageSlab::ptr slab, size_t offset) :
+      _image(img),
+      _y(y),
+      _data(slab->acquire_row(offset, img->row_size())),
+      _slab(slab),
+      _size(img->row_size())
     {}
 
     ~ImageRow() {
-      if (_data != nullptr)
-	delete [] _data;
+      if (_slab)
+	_slab->release_row(_data, _size);
+      else
+	RowBufferPool::release(_data, _size);
     }
 
     //! The width of the image
@@ -236,6 +377,112 @@ namespace PhotoFinish {
   };
 
 
+  template <typename T>
+  inline T* Image::write_row_data(unsigned int y) {
+    check_row_alloc(y);
+    return _rows[y]->data<T>();
+  }
+
+  template <typename T>
+  inline T* Image::row_data(unsigned int y, unsigned int x, unsigned int c) const {
+    check_row_generated(y);
+    return _rows[y]->data<T>(x, c);
+  }
+
+
+  //! A lightweight, non-owning view of the rows of an image
+  /*!
+    The base pointer of every row is gathered once when the view is made, so
+    inner loops can index rows without copying shared pointers. Rows allocated
+    after the view was made are not seen, and rows freed since must not be used.
+   */
+  class ImageView {
+  private:
+    unsigned int _first;
+    std::vector<unsigned char*> _rows;
+    size_t _pixel_size, _plane_size;
+
+  public:
+    //! Constructor
+    /*!
+      \param img The image to view
+    */
+    inline ImageView(const Image& img) : ImageView(img, 0, img.height()) {}
+
+    inline ImageView(Image::ptr img) : ImageView(*img) {}
+
+    //! Constructor
+    /*!
+      Rows of a lazy image are produced if they have not been already.
+      \param img The image to view
+      \param first,last The range of rows to view, rows are still indexed by their y value
+    */
+    ImageView(const Image& img, unsigned int first, unsigned int last);
+
+    inline ImageView(Image::ptr img, unsigned int first, unsigned int last) : ImageView(*img, first, last) {}
+
+    //! The first row in the view
+    inline unsigned int first(void) const { return _first; }
+
+    //! One past the last row in the view
+    inline unsigned int last(void) const { return _first + _rows.size(); }
+
+    //! Retun the distance in bytes between pixels
+    inline size_t pixel_size(void) const { return _pixel_size; }
+
+    template <typename T = unsigned char>
+    inline T* data(unsigned int y, unsigned int x = 0, unsigned int c = 0) const { return (T*)(_rows[y - _first] + (x * _pixel_size) + (c * _plane_size)); }
+
+  };
+
+
+  //! Frees the rows of a source image once no unfinished output row needs them
+  /*!
+    Output rows can be finished in any order by parallel loops, so a source
+    row is only freed once every output row before the first unfinished one
+    is done, and that unfinished row does not need it.
+   */
+  class RowReleaser {
+  private:
+    Image::ptr _src;
+    std::vector<bool> _done;
+    unsigned int _mark, _freed;
+    std::mutex _lock;
+
+  public:
+    //! Constructor
+    /*!
+      \param src The source image whose rows will be freed
+      \param dest_height The number of output rows
+    */
+    RowReleaser(Image::ptr src, unsigned int dest_height) :
+      _src(src),
+      _done(dest_height, false),
+      _mark(0), _freed(0)
+    {}
+
+    //! Mark an output row as finished
+    /*!
+      \param y The output row
+      \param first_needed Function returning the first source row used by a given output row
+    */
+    template <typename F>
+    void finish(unsigned int y, F first_needed) {
+      std::lock_guard<std::mutex> lock(_lock);
+      _done[y] = true;
+      while ((_mark < _done.size()) && _done[_mark])
+	_mark++;
+
+      unsigned int limit = _mark < _done.size() ? first_needed(_mark) : _src->height();
+      if (limit > _src->height())
+	limit = _src->height();
+      for (; _freed < limit; _freed++)
+	_src->free_row(_freed);
+    }
+
+  };
+
+
   //! A template function that returns the 'scale' value of a type.
   template <typename T>
   T scaleval(void);
@@ -252,6 +499,9 @@ namespace PhotoFinish {
   template <>
   inline unsigned long long scaleval<unsigned long long>(void) { return 0xffffffffffffffff; }
 
+  template <>
+  inline half scaleval<half>(void) { return 1.0f; }
+
   template <>
   inline float scaleval<float>(void) { return 1.0; }
 
@@ -299,6 +549,11 @@ namespace PhotoFinish {
     return round(v);
   }
 
+  template <>
+  inline half limitval<half>(SAMPLE v) {
+    return half(v);
+  }
+
   template <>
   inline float limitval<float>(SAMPLE v) {
     return v;
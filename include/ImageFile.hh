@@ -20,6 +20,7 @@
 
 #include <string>
 #include <memory>
+#include <mutex>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -37,6 +38,9 @@ namespace fs = boost::filesystem;
 
 namespace PhotoFinish {
 
+  //! Serialises use of Exiv2, which is not thread-safe
+  extern std::mutex exiv2_mutex;
+
   //! Class for holding filename and the image format
   class ImageFilepath {
   private:
@@ -113,6 +117,21 @@ namespace PhotoFinish {
     */
     virtual Image::ptr read(Destination::ptr dest) = 0;
 
+    //! Read the file into an image whose rows are decoded as they are needed
+    /*!
+      Formats that cannot decode row by row read the whole image at once.
+      \return A new Image object
+    */
+    Image::ptr read_lazy(void);
+
+    //! Read the file into an image whose rows are decoded as they are needed
+    /*!
+      Formats that cannot decode row by row read the whole image at once.
+      \param dest A Destination object where some information from the file will be placed
+      \return A new Image object
+    */
+    virtual Image::ptr read_lazy(Destination::ptr dest);
+
   }; // class ImageReader
 
 
@@ -122,6 +141,7 @@ namespace PhotoFinish {
   protected:
     const fs::path _filepath;
     bool _is_open;
+    mutable bool _defer_tags, _tags_deferred;
 
     //! Private constructor
     ImageWriter(const fs::path fp);
@@ -152,6 +172,12 @@ namespace PhotoFinish {
     */
     virtual void write(Image::ptr img, Destination::ptr dest, bool can_free = false) = 0;
 
+    //! Don't embed tags at the end of write(), leave it for embed_deferred_tags()
+    inline void defer_tags(void) { _defer_tags = true; }
+
+    //! Embed the tags that write() would have embedded, if any
+    void embed_deferred_tags(Image::ptr img) const;
+
   }; // class ImageWriter
 
 
@@ -212,13 +238,18 @@ namespace PhotoFinish {
 
 #ifdef HAZ_TIFF
   //! TIFF file reader
+  class TIFFrowReader;
+
   class TIFFreader : public ImageReader {
   private:
+    std::weak_ptr<TIFFrowReader> _rows;	// Generator of the last lazy read, which clears _is_open when it closes the file
 
   public:
     TIFFreader(const fs::path filepath);
+    ~TIFFreader();
 
     Image::ptr read(Destination::ptr dest);
+    Image::ptr read_lazy(Destination::ptr dest);
   }; // class TIFFreader
 
 
@@ -411,4 +442,12 @@ namespace PhotoFinish {
   }; // class SOLwriter
 
   std::string format_byte_size(uint64_t bytes);
+
+  //! Parse a size in bytes with an optional suffix, e.g. "512M" or "8GiB"
+  /*!
+    \param text The text to parse
+    \param bytes Set to the size in bytes
+    \return False if the text could not be parsed
+  */
+  bool parse_byte_size(const std::string& text, uint64_t& bytes);
 }
@@ -0,0 +1,136 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+namespace PhotoFinish {
+
+  //! A large block of memory holding a run of consecutive image rows
+  /*!
+    The memory is only mapped when the first row is acquired, and is
+    unmapped again as soon as every acquired row has been released. In
+    between, the pages of each chunk are given back (and no longer counted
+    by MemoryBudget) once none of its rows are acquired, so an image that
+    only keeps a window of rows only uses the memory under that window.
+
+    A slab can also be backed by a temporary file, for images bigger than
+    the machine's memory. The kernel then pages rows in and out as needed.
+   */
+  class ImageSlab {
+  private:
+    size_t _size;			// Size in bytes of the mapping
+    bool _file_backed;
+    unsigned char *_data;
+    unsigned int _live_rows;
+    std::vector<unsigned int> _chunk_rows;	// Number of acquired rows in each chunk
+    std::mutex _lock;
+
+    void _map(void);
+    void _map_file(void);
+    void _unmap(void);
+
+    //! The size in bytes of chunk 'c', the last one may be smaller
+    inline size_t _chunk_bytes(size_t c) const { return _size - (c * chunk_size) < chunk_size ? _size - (c * chunk_size) : chunk_size; }
+
+    //! Give back the pages of chunk 'c' and stop counting them
+    void _release_chunk(size_t c);
+
+  public:
+    //! Shared pointer for an ImageSlab
+    typedef std::shared_ptr<ImageSlab> ptr;
+
+    //! Ask the kernel to back slabs with transparent huge pages
+    static bool use_huge_pages;
+
+    //! The most address space in bytes kept mapped for reuse after slabs are released
+    /*!
+      The pages of spare mappings have already been given back, so they use
+      no memory and are not counted by MemoryBudget.
+    */
+    static size_t max_spare;
+
+    //! Back the slabs of every image with temporary files
+    static bool use_files;
+
+    //! Back the slabs of images at least this big (in bytes) with temporary files, zero for never
+    /*!
+      Defaults to half of the physical memory.
+    */
+    static size_t file_threshold;
+
+    //! Directory for the temporary files
+    /*!
+      Defaults to $TMPDIR, or /var/tmp since /tmp is often in memory.
+    */
+    static std::string temp_dir;
+
+    //! Alignment of each row within a slab, in bytes
+    static const size_t row_alignment = 64;
+
+    //! Target size of a slab, in bytes
+    static const size_t target_size = 64 << 20;
+
+    //! Size of the chunks whose pages are counted and given back together, the same as a transparent huge page
+    static const size_t chunk_size = 2 << 20;
+
+    //! Constructor
+    /*!
+      \param size Size in bytes of the slab
+      \param file_backed Back the slab with a temporary file instead of anonymous memory
+    */
+    ImageSlab(size_t size, bool file_backed = false);
+
+    //! Destructor
+    ~ImageSlab();
+
+    ImageSlab(const ImageSlab&) = delete;
+    ImageSlab& operator=(const ImageSlab&) = delete;
+
+    //! The size in bytes of this slab
+    inline size_t size(void) const { return _size; }
+
+    //! Is this slab backed by a temporary file?
+    inline bool file_backed(void) const { return _file_backed; }
+
+    //! Should an image of this many bytes be backed by temporary files?
+    static bool want_files(size_t image_size);
+
+    //! Acquire a row, mapping the slab if needed
+    /*!
+      \param offset Offset in bytes of the row from the start of the slab
+      \param length Size in bytes of the row
+      \return Pointer to the start of the row
+    */
+    unsigned char* acquire_row(size_t offset, size_t length);
+
+    //! Release a row, giving back the chunks no other row uses and unmapping the slab if it was the last one
+    /*!
+      \param row Pointer returned by acquire_row()
+      \param length Size in bytes of the row
+    */
+    void release_row(const unsigned char* row, size_t length);
+
+  }; // class ImageSlab
+
+}; // namespace PhotoFinish
@@ -19,6 +19,13 @@
 #pragma once
 
 #include <memory>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <stdint.h>
 #include "Destination_items.hh"
 #include "Exception.hh"
 #include "Definable.hh"
@@ -27,10 +34,12 @@
 namespace PhotoFinish {
 
   //! Creates and stores coefficients for cropping and resizing an image
-  class Kernel1Dvar {
+  class Kernel1Dvar : public std::enable_shared_from_this<Kernel1Dvar> {
   protected:
     unsigned int *_size, *_start;
-    SAMPLE **_weights;
+    unsigned int _taps;			// Number of weights for every output pixel/row, padded
+    SAMPLE *_weights;			// _to_size_i rows of _taps weights in one aligned block
+    int16_t *_int_weights;		// Fixed-point copies of the weights, if wanted
     double _scale, _to_size;
     unsigned int _to_size_i;
 
@@ -40,33 +49,129 @@ namespace PhotoFinish {
     //! Build the kernel; used by derived classes
     void build(double from_start, double from_size, unsigned int from_max);
 
+    //! Build fixed-point copies of the weights, for convolving 8 and 16-bit images with integers
+    void build_integer(void);
+
     //! The size of this filter
     virtual double range(void) const = 0;
 
     //! Evaluate the filter at a given point
     virtual SAMPLE eval(double x) const = 0;
 
+    //! Factor taking distances in input pixels to the filter's units when reducing
+    /*!
+      \param range The range of the filter in input pixels, range() times the scale
+      \return The reciprocal of the scale, so that the filter covers range() output pixels
+    */
+    virtual double input_scale(double range) const;
+
+  public:
+    //! Name of the filter, for messages
+    virtual std::string name(void) const = 0;
+
+  protected:
+
+    //! Convolve one row horizontally, writing the output as type O
+    template <typename T, int channels, typename O>
+    void _convolve_row_h(const T* inrow, O* out) const;
+
     template <typename T, int channels>
-    void convolve_h_type_channels(Image::ptr src, Image::ptr dest, bool can_free = false);
+    void convolve_h_type_channels(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free);
 
     template <typename T>
-    void convolve_h_type(Image::ptr src, Image::ptr dest, bool can_free = false);
+    void convolve_h_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free);
 
     template <typename T, int channels>
-    void convolve_v_type_channels(Image::ptr src, Image::ptr dest, bool can_free = false);
+    void convolve_h_integer(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free);
+
+    template <typename T, int channels>
+    void convolve_v_type_channels(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
 
     template <typename T>
-    void convolve_v_type(Image::ptr src, Image::ptr dest, bool can_free = false);
+    void convolve_v_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
+
+    template <typename T, int channels>
+    void convolve_v_integer(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
+
+    //! Build a new kernel, without looking in the cache
+    static std::shared_ptr<Kernel1Dvar> _build(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size);
+
+    typedef std::list<std::pair<std::string, std::shared_ptr<Kernel1Dvar> > > cache_list;
+    static cache_list _cache;		// Most recently used first
+    static std::mutex _cache_lock;
+    static std::atomic<unsigned long int> _cache_hits, _cache_misses;
+
+    template <typename T, int channels>
+    static void _convolve_hv_type_channels(const Kernel1Dvar& h_kernel, const Kernel1Dvar& v_kernel, Image::ptr src, Image::ptr dest, bool h_first,
+					   unsigned int first, unsigned int last, RowReleaser* releaser);
+
+    template <typename T>
+    static void _convolve_hv_type(const Kernel1Dvar& h_kernel, const Kernel1Dvar& v_kernel, Image::ptr src, Image::ptr dest, bool h_first,
+				  unsigned int first, unsigned int last, RowReleaser* releaser);
+
+    template <typename T, int channels>
+    static void _convolve_h_many_type_channels(const std::vector<std::shared_ptr<Kernel1Dvar> >& kernels, const std::vector<unsigned int>& first, const std::vector<unsigned int>& last,
+					       Image::ptr src, const std::vector<Image::ptr>& dests, bool can_free);
+
+    template <typename T>
+    static void _convolve_h_many_type(const std::vector<std::shared_ptr<Kernel1Dvar> >& kernels, const std::vector<unsigned int>& first, const std::vector<unsigned int>& last,
+				      Image::ptr src, const std::vector<Image::ptr>& dests, bool can_free);
+
+    //! The fewest output rows in a band of convolve_hv(), so that the rows convolved again at its start are a small part of it
+    unsigned int _min_band_rows(void) const;
+
+    //! Make an empty image for the output of convolve_h()
+    Image::ptr _new_h_image(Image::ptr img) const;
+
+    //! Make an empty image for the output of convolve_v()
+    Image::ptr _new_v_image(Image::ptr img) const;
 
   public:
     //! Shared pointer for a Kernel1Dvar
     typedef std::shared_ptr<Kernel1Dvar> ptr;
 
+    //! Called with the output image and the number of rows of it finished so far
+    typedef std::function<void(Image::ptr, unsigned int)> rows_done_func;
+
+    //! Number of fractional bits in the fixed-point weights
+    /*!
+      With 14 bits a 16-bit sample times the weights of even a ringing
+      filter still fits in a 32-bit sum.
+    */
+    static const int integer_bits = 14;
+
+    //! Number of values (pixels × channels) in each strip of a row in the vertical pass
+    /*!
+      Each input row under the filter is added into a strip of sums in turn,
+      so the sums stay in L1 cache and the input rows are read in order.
+    */
+    static const unsigned int v_strip_values = 4096;
+
+    //! Tap counts are rounded up to a multiple of this, to fill whole SIMD vectors
+    /*!
+      Small filters that need no more than half of this are padded to half.
+    */
+    static const unsigned int tap_align = 8;
+
+    //! Maximum number of built kernels kept for reuse
+    static unsigned int cache_size;
+
+    //! If non-zero, crop positions and sizes are rounded to a multiple of this (in pixels) so that more kernels can be reused
+    static double cache_quantum;
+
+    //! Number of kernels that were found in the cache
+    static unsigned long int cache_hits(void) { return _cache_hits; }
+
+    //! Number of kernels that had to be built
+    static unsigned long int cache_misses(void) { return _cache_misses; }
+
     //! Emoty constructor
     Kernel1Dvar();
 
     //! Named constructor
     /*! Create a Kernel1Dvar object using the filter name in the D_resize object.
+      Kernels are shared between callers asking for the same filter and geometry,
+      the most recently used cache_size of them are kept.
       \param dr A D_resize object which will supply our parameters.
       \param from_start The starting point of the crop/resample
       \param from_size The size of the crop/resample
@@ -92,6 +197,87 @@ namespace PhotoFinish {
      */
     Image::ptr convolve_v(Image::ptr img, bool can_free = false);
 
+    //! Resize an image in both directions in one pass
+    /*!
+      Whichever order of the passes needs fewer multiply-adds is used. With
+      the horizontal pass first, each thread keeps a ring of horizontally
+      convolved rows just tall enough for the vertical kernel and works on a
+      band of output rows. With the vertical pass first, each output row
+      needs only one intermediate row. Kernels with fixed-point weights use
+      convolve_h() and convolve_v() instead.
+
+      With 'rows_done', output rows are made in chunks from the top and it is
+      called after each one, e.g. to sharpen the rows and free them before
+      the rest of the image is made. The time shown with -b includes it.
+      \param h_kernel Kernel for the horizontal direction
+      \param v_kernel Kernel for the vertical direction
+      \param img Source image
+      \param can_free Can rows of the source image be freed once used?
+      \param rows_done Optional function called as rows of the output are finished
+      \return New image
+     */
+    static Image::ptr convolve_hv(ptr h_kernel, ptr v_kernel, Image::ptr img, bool can_free = false, rows_done_func rows_done = nullptr);
+
+    //! Convolve an image horizontally with several kernels, reading each source row once
+    /*!
+      \param img Source image
+      \param kernels The kernels
+      \param first,last The range of rows to convolve with each kernel
+      \param can_free Free each source row once every kernel has used it?
+      \return A new image for each kernel, with only the rows in its range
+     */
+    static std::vector<Image::ptr> convolve_h_many(Image::ptr img, const std::vector<ptr>& kernels,
+						   const std::vector<unsigned int>& first, const std::vector<unsigned int>& last,
+						   bool can_free = false);
+
+    //! Convolve an image horizontally with this kernel, producing rows only as they are needed
+    /*!
+      Rows of the source image are freed as soon as they have been used.
+      \param img Source image
+      \param can_free Can rows of the source image be freed once used?
+      \return New lazy image
+     */
+    Image::ptr convolve_h_lazy(Image::ptr img, bool can_free = true);
+
+    //! Convolve an image vertically with this kernel, producing rows only as they are needed
+    /*!
+      Only the source rows under the kernel's taps are kept, the rest are freed.
+      \param img Source image
+      \param can_free Can rows of the source image be freed once used?
+      \return New lazy image
+     */
+    Image::ptr convolve_v_lazy(Image::ptr img, bool can_free = true);
+
+    //! Convolve a range of rows horizontally
+    /*!
+      \param src Source image, rows first to last-1 must already be available
+      \param dest Destination image
+      \param first,last The range of rows to convolve
+      \param can_free Free each source row after it is convolved?
+     */
+    void convolve_h_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free = false);
+
+    //! Convolve a range of output rows vertically
+    /*!
+      \param src Source image, every row under the taps of the output rows must already be available
+      \param dest Destination image
+      \param first,last The range of output rows to produce
+      \param releaser Optional object used to free source rows once they are no longer needed
+     */
+    void convolve_v_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser = nullptr);
+
+    //! The first input pixel/row used by output pixel/row 'i'
+    inline unsigned int start(unsigned int i) const { return _start[i]; }
+
+    //! The number of input pixels/rows used by output pixel/row 'i'
+    inline unsigned int size(unsigned int i) const { return _size[i]; }
+
+    //! The number of weights stored for every output pixel/row, including zero padding
+    inline unsigned int taps(void) const { return _taps; }
+
+    //! The weights of output pixel/row 'i', starting at input pixel/row start(i)
+    inline const SAMPLE* weights(unsigned int i) const { return _weights + ((size_t)i * _taps); }
+
   };
 
   //! Lanczos filter
@@ -103,6 +289,9 @@ namespace PhotoFinish {
     double range(void) const;
     SAMPLE eval(double x) const;
 
+    //! Stretches the lobes to a whole number of input pixels
+    double input_scale(double range) const;
+
   public:
     //! Empty constructor
     Lanczos1D();
@@ -117,6 +306,105 @@ namespace PhotoFinish {
       \param to_size The size of the output
     */
     Lanczos1D(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size);
+
+    std::string name(void) const;
+  };
+
+  //! Box filter, the average of the pixels under each output pixel
+  class Box1D : public Kernel1Dvar {
+  private:
+    double range(void) const;
+    SAMPLE eval(double x) const;
+
+  public:
+    //! Constructor
+    /*!
+      \param from_start The starting point of the crop/resample
+      \param from_size The size of the crop/resample
+      \param from_max The size (maximum dimenstion) of the input
+      \param to_size The size of the output
+    */
+    Box1D(double from_start, double from_size, unsigned int from_max, double to_size);
+
+    std::string name(void) const;
+  };
+
+  //! Triangle (linear interpolation) filter
+  class Triangle1D : public Kernel1Dvar {
+  private:
+    double range(void) const;
+    SAMPLE eval(double x) const;
+
+  public:
+    //! Constructor
+    /*!
+      \param from_start The starting point of the crop/resample
+      \param from_size The size of the crop/resample
+      \param from_max The size (maximum dimenstion) of the input
+      \param to_size The size of the output
+    */
+    Triangle1D(double from_start, double from_size, unsigned int from_max, double to_size);
+
+    std::string name(void) const;
+  };
+
+  //! Cubic filters from the Mitchell-Netravali family
+  class Cubic1D : public Kernel1Dvar {
+  private:
+    double _p0, _p2, _p3, _q0, _q1, _q2, _q3;	// Coefficients of the inner and outer pieces
+
+    double range(void) const;
+    SAMPLE eval(double x) const;
+
+  protected:
+    //! Constructor
+    /*!
+      \param b,c The B and C parameters of the filter
+      \param from_start The starting point of the crop/resample
+      \param from_size The size of the crop/resample
+      \param from_max The size (maximum dimenstion) of the input
+      \param to_size The size of the output
+    */
+    Cubic1D(double b, double c, double from_start, double from_size, unsigned int from_max, double to_size);
+  };
+
+  //! Mitchell-Netravali filter, B = C = 1/3
+  class Mitchell1D : public Cubic1D {
+  public:
+    Mitchell1D(double from_start, double from_size, unsigned int from_max, double to_size);
+
+    std::string name(void) const;
+  };
+
+  //! Catmull-Rom spline, B = 0 and C = 1/2
+  class CatmullRom1D : public Cubic1D {
+  public:
+    CatmullRom1D(double from_start, double from_size, unsigned int from_max, double to_size);
+
+    std::string name(void) const;
+  };
+
+  //! Gaussian filter, cut off at three standard deviations
+  class Gaussian1D : public Kernel1Dvar {
+  private:
+    double _radius;		//! Radius, three times the standard deviation
+    double _r_2sigma2;		//! Reciprocal of twice the variance
+
+    double range(void) const;
+    SAMPLE eval(double x) const;
+
+  public:
+    //! Constructor
+    /*!
+      \param dr A D_resize object which will supply the radius (default 1.5, i.e a standard deviation of 0.5)
+      \param from_start The starting point of the crop/resample
+      \param from_size The size of the crop/resample
+      \param from_max The size (maximum dimenstion) of the input
+      \param to_size The size of the output
+    */
+    Gaussian1D(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size);
+
+    std::string name(void) const;
   };
 
 
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include "Image.hh"
 #include "Exception.hh"
 #include "Definable.hh"
@@ -29,10 +30,11 @@ namespace PhotoFinish {
   class D_sharpen;
 
   //! Creates and stores coefficients for convolving an image
-  class Kernel2D {
+  class Kernel2D : public std::enable_shared_from_this<Kernel2D> {
   protected:
     short unsigned int _width, _height, _centrex, _centrey;
     SAMPLE **_values;
+    bool _luminance;		// Only convolve the first channel of Lab and greyscale images
 
     //! Private constructor for derived classes
     Kernel2D(short unsigned int w, short unsigned int h, short unsigned int cx, short unsigned int cy);
@@ -41,10 +43,19 @@ namespace PhotoFinish {
     Kernel2D(short unsigned int size, short unsigned int centre);
 
     template <typename T>
-    void convolve_type(Image::ptr src, Image::ptr dest, bool can_free = false);
+    void convolve_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
 
     template <typename T, int channels>
-    void convolve_type_channels(Image::ptr src, Image::ptr dest, bool can_free = false);
+    void convolve_type_channels(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
+
+    //! Create a kernel for the method in a D_sharpen object
+    static std::shared_ptr<Kernel2D> _create(const D_sharpen& ds, bool windowed);
+
+    //! Make an empty image for the output of convolve()
+    Image::ptr _new_image(Image::ptr img) const;
+
+    //! The number of channels to convolve, starting from the first, the rest are copied
+    unsigned int _convolved_channels(const CMS::Format& format) const;
 
   public:
     //! Shared pointer for a Kernel2D
@@ -56,11 +67,15 @@ namespace PhotoFinish {
     //! Named constructor
     /*! Create a Kernel2D object using the parameters in the D_sharpen object.
       \param ds A D_sharpen object which will supply our parameters.
+      \param windowed Only use a kernel that needs a window of source rows, e.g. for images made as their rows are needed
     */
-    static ptr create(const D_sharpen& ds);
+    static ptr create(const D_sharpen& ds, bool windowed = false);
+
+    //! Convolve only the lightness channel of Lab and greyscale images
+    inline void set_luminance(bool l = true) { _luminance = l; }
 
     //! Destructor
-    ~Kernel2D();
+    virtual ~Kernel2D();
 
     //! Convolve and image with this kernel and produce a new image
     /*!
@@ -69,6 +84,35 @@ namespace PhotoFinish {
       \return New image
      */
     Image::ptr convolve(Image::ptr img, bool can_free = false);
+
+    //! Convolve an image with this kernel, producing rows only as they are needed
+    /*!
+      Only a window of source rows the height of the kernel is kept, the rest are freed.
+      \param img Source image
+      \return New lazy image
+     */
+    virtual Image::ptr convolve_lazy(Image::ptr img);
+
+    //! Convolve a range of rows
+    /*!
+      \param src Source image, every row under the kernel for the output rows must already be available
+      \param dest Destination image
+      \param first,last The range of output rows to produce
+      \param releaser Optional object used to free source rows once they are no longer needed
+     */
+    virtual void convolve_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser = nullptr);
+
+    //! Does each output row need only the source rows under the kernel?
+    virtual bool is_windowed(void) const { return true; }
+
+    //! Memory needed while convolving an image, besides the source and output images
+    virtual size_t extra_memory(unsigned int width, unsigned int height, const CMS::Format& format) const { return 0; }
+
+    //! The first source row used by output row 'y'
+    inline unsigned int first_row_needed(unsigned int y) const { return y > _centrey ? y - _centrey : 0; }
+
+    //! The last source row used by output row 'y'
+    inline unsigned int last_row_needed(unsigned int y, unsigned int height) const { return y + _height - _centrey <= height ? y + _height - _centrey - 1 : height - 1; }
   };
 
   //! GaussianSharpen kernel
@@ -88,6 +132,70 @@ namespace PhotoFinish {
     GaussianSharpen(const D_sharpen& ds);
   };
 
+  //! Unsharp mask, the original plus an amount times the difference from a Gaussian blur
+  /*!
+    The blur is done with two 1D passes, so the work per pixel grows with the
+    radius rather than its square. By default the amount is the one the
+    GaussianSharpen kernel with the same radius and sigma has, and near the
+    edges it changes the same way that kernel's does when it is clipped.
+   */
+  class UnsharpMask : public Kernel2D {
+  private:
+    std::vector<SAMPLE> _weights;	// 1D Gaussian, 2 × radius + 1 of them
+    SAMPLE _amount;
+    SAMPLE _sum2;			// Sum of the 2D kernel (the 1D sum squared)
+    SAMPLE _edge_scale;			// Turns the amount into the GaussianSharpen equivalent
+
+    template <typename T>
+    void convolve_rows_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
+
+  public:
+    //! Constructor
+    /*!
+      \param ds A D_sharpen object which will supply our parameters.
+    */
+    UnsharpMask(const D_sharpen& ds);
+
+    void convolve_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser = nullptr);
+  };
+
+  //! Unsharp mask with a recursive (Young-van Vliet) Gaussian blur
+  /*!
+    The blur takes the same time per pixel whatever the radius, but needs the
+    whole image: rows are blurred horizontally in parallel, then strips of
+    columns vertically. Used for radii over min_radius when the Gaussian is
+    not cut off much by the radius, or with 'method: recursive'.
+   */
+  class RecursiveUnsharpMask : public Kernel2D {
+  private:
+    SAMPLE _B, _b1, _b2, _b3;		// Filter coefficients, _b1 to _b3 already divided by b0
+    SAMPLE _amount;
+
+    template <typename T>
+    void convolve_rows_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser);
+
+  public:
+    //! Radii above this use the recursive filter by default
+    static const unsigned int min_radius = 8;
+
+    //! Constructor
+    /*!
+      \param ds A D_sharpen object which will supply our parameters.
+    */
+    RecursiveUnsharpMask(const D_sharpen& ds);
+
+    //! The whole image is needed, so this is the same as convolve()
+    Image::ptr convolve_lazy(Image::ptr img);
+
+    bool is_windowed(void) const { return false; }
+
+    //! The blurred copy of the whole image
+    size_t extra_memory(unsigned int width, unsigned int height, const CMS::Format& format) const;
+
+    //! Convolve a range of rows, every row of the source image must be available
+    void convolve_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser = nullptr);
+  };
+
 
 
 }
@@ -0,0 +1,85 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+
+namespace PhotoFinish {
+
+  //! Keeps count of the memory used for image data, and how much may be used
+  class MemoryBudget {
+  private:
+    static std::atomic<size_t> _in_use;
+    static size_t _limit;
+    static thread_local std::atomic<size_t>* _account;
+    static std::atomic<bool> _waiting;
+    static std::function<void(void)> _waker;
+
+  public:
+    //! Set the most memory that image data should use, or zero for no limit
+    static inline void set_limit(size_t bytes) { _limit = bytes; }
+
+    //! The most memory that image data should use, or zero for no limit
+    static inline size_t limit(void) { return _limit; }
+
+    //! The memory currently used for image data
+    static inline size_t in_use(void) { return _in_use.load(); }
+
+    //! Record that some image data has been allocated
+    static inline void allocated(size_t bytes) {
+      _in_use.fetch_add(bytes, std::memory_order_relaxed);
+      if (_account != nullptr)
+	_account->fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    //! Record that some image data has been freed
+    static inline void freed(size_t bytes) {
+      _in_use.fetch_sub(bytes);
+      if (_waiting.load() && _waker)
+	_waker();
+    }
+
+    //! Also add the memory allocated on this thread to a counter, e.g. of the task running on it
+    /*!
+      \param account The counter, or nullptr to stop
+    */
+    static inline void set_account(std::atomic<size_t>* account) { _account = account; }
+
+    //! Set the function called when memory is freed while something is waiting for it
+    static inline void set_waker(std::function<void(void)> waker) { _waker = waker; }
+
+    //! Say whether something is waiting for memory to be freed
+    /*!
+      Set before looking at in_use(), so that a free between that and
+      starting to wait still calls the waker.
+    */
+    static inline void set_waiting(bool waiting) { _waiting.store(waiting); }
+
+    //! Would allocating some more memory stay within the limit?
+    /*!
+      \param bytes Size of the new allocation
+      \param reserved Memory that has been promised to work in progress but not allocated yet
+    */
+    static bool fits(size_t bytes, size_t reserved = 0);
+
+  }; // class MemoryBudget
+
+}; // namespace PhotoFinish
@@ -0,0 +1,48 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+
+namespace PhotoFinish {
+
+  //! A pool of buffers for rows that own their data
+  /*!
+    Each thread keeps its own lists of free buffers, sorted into size
+    classes, so that a stage freeing rows leaves buffers ready for the next
+    stage allocating rows of a similar size. Buffers start on a cache line.
+   */
+  class RowBufferPool {
+  public:
+    //! The most memory in bytes that each thread keeps in its free lists
+    static size_t max_cached;
+
+    //! Get a buffer of at least the given size
+    static unsigned char* acquire(size_t size);
+
+    //! Give back a buffer
+    /*!
+      \param buffer A buffer from acquire(), possibly from another thread
+      \param size The size it was acquired with
+    */
+    static void release(unsigned char* buffer, size_t size);
+
+  }; // class RowBufferPool
+
+}; // namespace PhotoFinish
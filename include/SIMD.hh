@@ -0,0 +1,88 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <stddef.h>
+
+namespace PhotoFinish {
+
+  //! Instruction set extensions that the convolution loops can use
+  enum class SIMDLevel {
+    Scalar,
+    SSE4_2,
+    AVX2,	// AVX2 with FMA
+    AVX512,	// AVX-512F
+  };
+
+  std::ostream& operator<< (std::ostream& out, SIMDLevel level);
+
+  //! Single precision convolution loops written for each SIMDLevel
+  /*!
+    The best level the CPU supports is picked when the program starts.
+    Every function works at every level, falling back to plain loops.
+   */
+  class SIMD {
+  private:
+    static SIMDLevel _level;
+
+  public:
+    //! The best level the CPU supports
+    static SIMDLevel supported(void);
+
+    //! The level in use
+    static SIMDLevel level(void);
+
+    //! Use a lower level, e.g. to compare speeds. It is limited to what the CPU supports.
+    static void set_level(SIMDLevel level);
+
+    //! Parse a level name ("scalar", "sse4.2", "avx2", or "avx512")
+    /*!
+      \return False if the name was not recognised
+    */
+    static bool parse_level(const std::string& name, SIMDLevel& level);
+
+    //! Weighted sum of several rows
+    /*!
+      out[i] = sum of weights[j] * rows[j][i] for every j < taps
+      \param rows Pointers to the input rows
+      \param weights One weight per input row
+      \param taps Number of input rows
+      \param out Output row
+      \param n Number of values (width × channels) in each row
+    */
+    static void weighted_sum_rows(const float* const* rows, const float* weights, unsigned int taps, float* out, size_t n);
+
+    //! Horizontally convolve one row of interleaved pixels
+    /*!
+      \param in Input row
+      \param out Output row
+      \param out_width Number of output pixels
+      \param channels Number of channels in each pixel
+      \param start The first input pixel used by each output pixel
+      \param weights 'taps' weights for each output pixel, one after another
+      \param taps The number of input pixels used by every output pixel
+    */
+    static void convolve_row_h(const float* in, float* out, unsigned int out_width, unsigned int channels,
+			       const unsigned int* start, const float* weights, unsigned int taps);
+
+  }; // class SIMD
+
+}; // namespace PhotoFinish
@@ -0,0 +1,160 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+namespace PhotoFinish {
+
+  class WorkQueue;
+
+  //! A unit of work in a WorkQueue, that can depend on other tasks
+  class Task {
+  private:
+    std::string _name;
+    std::function<void(void)> _function;
+    unsigned int _priority, _sequence;
+    unsigned int _waiting;		// Number of unfinished dependencies
+    bool _failed;			// Set when a dependency failed
+    bool _barrier;			// Runs even if a dependency failed
+    bool _finished;
+    size_t _memory;			// Estimate of the memory the task will allocate
+    std::atomic<size_t> _allocated;	// Memory allocated so far on the task's own thread
+    std::vector<std::shared_ptr<Task>> _dependents;
+
+    friend class WorkQueue;
+
+  public:
+    //! Shared pointer for a Task
+    typedef std::shared_ptr<Task> ptr;
+
+    //! Constructor
+    /*!
+      \param name Name of the task, used in messages
+      \param priority Lower values are run first when several tasks are ready
+      \param f Function that does the work
+    */
+    Task(const std::string& name, unsigned int priority, std::function<void(void)> f);
+
+    //! The name of this task
+    inline const std::string& name(void) const { return _name; }
+
+    //! Estimate of the memory this task will allocate
+    inline size_t memory(void) const { return _memory; }
+
+    //! Set the estimate of the memory this task will allocate
+    /*!
+      Must be called before the task is ready to run, e.g. by a task it depends on.
+    */
+    inline void set_memory(size_t bytes) { _memory = bytes; }
+
+  }; // class Task
+
+  //! Runs a graph of tasks on a bounded pool of threads
+  /*!
+    Tasks only start once every task they depend on has finished. If a task
+    throws an exception, the message is printed and all tasks that depend on
+    it are skipped, except for barriers.
+
+    When MemoryBudget has a limit, a task only starts if the memory it
+    expects to allocate will fit. Until it does, only tasks that expect to
+    allocate nothing may overtake it. If nothing else is running, it starts
+    anyway. Running tasks only hold on to the part of their estimate that
+    they have not allocated yet, the rest is already counted by MemoryBudget.
+    Workers waiting for memory are woken whenever some is freed.
+   */
+  class WorkQueue {
+  private:
+    unsigned int _num_workers, _threads_per_worker;
+    unsigned int _sequence, _remaining, _waiting_for_memory;
+    std::set<Task::ptr> _running;
+    std::mutex _lock;
+    std::condition_variable _cond;
+
+    struct earlier {
+      inline bool operator()(const Task::ptr& a, const Task::ptr& b) const {
+	if (a->_priority != b->_priority)
+	  return a->_priority < b->_priority;
+	return a->_sequence < b->_sequence;
+      }
+    };
+    std::set<Task::ptr, earlier> _ready;
+
+    //! The memory estimates of the running tasks, less what they have already allocated
+    size_t _reserved(void) const;
+
+    Task::ptr _admit(void);
+    void _worker(void);
+    void _finish(Task::ptr task, bool failed);
+
+    //! Put a new task into the graph
+    void _add(Task::ptr task, const std::vector<Task::ptr>& deps);
+
+  public:
+    //! Constructor
+    /*!
+      \param workers Number of worker threads. OpenMP threads are shared out between them.
+    */
+    WorkQueue(unsigned int workers);
+
+    //! Destructor
+    ~WorkQueue();
+
+    //! The number of worker threads
+    inline unsigned int num_workers(void) const { return _num_workers; }
+
+    //! Add a task to the graph
+    /*!
+      \param name Name of the task, used in messages
+      \param priority Lower values are run first when several tasks are ready
+      \param f Function that does the work
+      \param deps Tasks that must finish before this one starts
+      \param memory Estimate of the memory the task will allocate
+      \return The new task
+    */
+    Task::ptr add(const std::string& name, unsigned int priority, std::function<void(void)> f, const std::vector<Task::ptr>& deps = {}, size_t memory = 0);
+
+    //! Add a barrier task, that runs once its dependencies have finished whether they failed or not
+    Task::ptr add_barrier(const std::string& name, unsigned int priority, const std::vector<Task::ptr>& deps);
+
+    //! Add a barrier task that does some work, e.g. cleaning up after tasks that may have failed
+    Task::ptr add_barrier(const std::string& name, unsigned int priority, std::function<void(void)> f, const std::vector<Task::ptr>& deps);
+
+    //! Make an existing task wait for another one
+    /*!
+      This lets a running task add more work that must be done before a task
+      that is still waiting on it, e.g. a barrier.
+      \param task A task that has not started yet
+      \param dep The task it must now also wait for
+    */
+    void add_dependency(Task::ptr task, Task::ptr dep);
+
+    //! Run all of the tasks, returning when they have all finished
+    void run(void);
+
+  }; // class WorkQueue
+
+}; // namespace PhotoFinish
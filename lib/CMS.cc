@@ -17,10 +17,15 @@
         along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <iostream>
 #include <fstream>
+#include <stdexcept>
+#include <sstream>
+#include <iomanip>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <string.h>
+#include <stdlib.h>
 #include "CMS.hh"
 
 namespace fs = boost::filesystem;
@@ -89,6 +94,7 @@ namespace CMS {
   Profile::Profile()
     : _profile(cmsCreateProfilePlaceholder(nullptr))
   {
+    _set_hash();
   }
 
   Profile::Profile(const Profile& other) :
@@ -102,16 +108,19 @@ namespace CMS {
       _profile = cmsOpenProfileFromMem(data, length);
       delete [] data;
     }
+    _set_hash();
   }
 
   Profile::Profile(fs::path filepath)
     : _profile(cmsOpenProfileFromFile(filepath.generic_string().c_str(), "r"))
   {
+    _set_hash();
   }
 
   Profile::Profile(const unsigned char* data, cmsUInt32Number size)
     : _profile(cmsOpenProfileFromMem(data, size))
   {
+    _set_hash();
   }
 
   Profile::Profile(std::istream stream)
@@ -125,14 +134,17 @@ namespace CMS {
   }
 
   Profile::ptr Profile::Lab4(void) {
-    return std::make_shared<Profile>(cmsCreateLab4Profile(nullptr));
+    static Profile::ptr profile = std::make_shared<Profile>(cmsCreateLab4Profile(nullptr));
+    return profile;
   }
       
   Profile::ptr Profile::sRGB(void) {
-    return std::make_shared<Profile>(cmsCreate_sRGBProfile());
+    static Profile::ptr profile = std::make_shared<Profile>(cmsCreate_sRGBProfile());
+    return profile;
   }
       
-  Profile::ptr Profile::sGrey(void) {
+  //! Build the sGrey profile
+  static Profile::ptr build_sGrey(void) {
     cmsCIExyY D65;
     cmsWhitePointFromTemp(&D65, 6504);
     double Parameters[5] = {
@@ -147,12 +159,39 @@ namespace CMS {
     Profile::ptr profile = std::make_shared<Profile>(cmsCreateGrayProfile(&D65, gamma));
     cmsFreeToneCurve(gamma);
 
-    profile->write_MLU(cmsSigProfileDescriptionTag, "en", "AU", "sGrey built-in");
-    profile->write_MLU(cmsSigCopyrightTag, "en", "AU", "No copyright, use freely");
+    profile->set_description("en", "AU", "sGrey built-in");
+    profile->set_copyright("en", "AU", "No copyright, use freely");
 
     return profile;
   }
 
+  Profile::ptr Profile::sGrey(void) {
+    static Profile::ptr profile = build_sGrey();
+    return profile;
+  }
+
+  void Profile::_set_hash(bool recompute) {
+    if (_profile == nullptr)
+      return;
+
+    cmsUInt8Number id[16];
+    cmsGetHeaderProfileID(_profile, id);
+    bool empty = true;
+    for (int i = 0; i < 16; i++)
+      if (id[i] != 0)
+	empty = false;
+    if (empty || recompute) {
+      cmsMD5computeID(_profile);
+      cmsGetHeaderProfileID(_profile, id);
+    }
+
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0');
+    for (int i = 0; i < 16; i++)
+      oss << std::setw(2) << (unsigned int)id[i];
+    _hash = oss.str();
+  }
+
   void Profile::write_MLU(cmsTagSignature sig, std::string language, std::string country, std::string text) {
     cmsMLU *MLU = cmsMLUalloc(nullptr, 1);
     if (MLU != nullptr) {
@@ -160,6 +199,7 @@ namespace CMS {
 	cmsWriteTag(_profile, sig, MLU);
       cmsMLUfree(MLU);
     }
+    _set_hash(true);
   }
 
   void Profile::write_MLU(cmsTagSignature sig, std::string language, std::string country, std::wstring text) {
@@ -169,6 +209,7 @@ namespace CMS {
 	cmsWriteTag(_profile, sig, MLU);
       cmsMLUfree(MLU);
     }
+    _set_hash(true);
   }
 
   std::string Profile::read_info(cmsInfoType type, std::string language, std::string country) const {
@@ -630,6 +671,15 @@ namespace CMS {
   {
   }
 
+  Transform::Transform(Profile::ptr link, const Format &informat, const Format &outformat,
+		       Intent intent, cmsUInt32Number flags)
+    : _transform(cmsCreateTransform(*link, (cmsUInt32Number)informat,
+				    nullptr, (cmsUInt32Number)outformat,
+				    (cmsUInt32Number)intent, flags)),
+      _one_is_planar(informat.is_planar() || outformat.is_planar())
+  {
+  }
+
   Transform::Transform(std::vector<Profile::ptr> profile,
 		       const Format &informat, const Format &outformat,
 		       Intent intent, cmsUInt32Number flags)
@@ -642,6 +692,115 @@ namespace CMS {
     cmsDeleteTransform(_transform);
   }
 
+  unsigned int Transform::cache_size = 16;
+  Transform::cache_list Transform::_cache;
+  std::mutex Transform::_cache_lock;
+  std::atomic<unsigned long int> Transform::_cache_hits(0), Transform::_cache_misses(0), Transform::_disk_hits(0);
+  fs::path Transform::disk_cache_dir;
+
+  Transform::ptr Transform::_build(Profile::ptr input, const Format &informat,
+				   Profile::ptr output, const Format &outformat,
+				   Intent intent, cmsUInt32Number flags, const std::string& key) {
+    // Device links store 16-bit tables, which would change the results of
+    // floating-point transforms and clip their out of gamut values
+    if (disk_cache_dir.empty() || informat.is_fp() || outformat.is_fp())
+      return std::make_shared<Transform>(input, informat, output, outformat, intent, flags);
+
+    // A different version of LCMS2 may optimise the transform differently
+    std::ostringstream oss;
+    oss << key << "-lcms" << cmsGetEncodedCMMversion() << ".icc";
+    fs::path filepath = disk_cache_dir / oss.str();
+    if (fs::exists(filepath)) {
+      // A file that can't be used is built again and replaced
+      try {
+	auto link = std::make_shared<Profile>(filepath);
+	if ((cmsHPROFILE)*link != nullptr) {
+	  auto ret = std::make_shared<Transform>(link, informat, outformat, intent, flags);
+	  if (ret->_transform != nullptr) {
+	    _disk_hits++;
+	    return ret;
+	  }
+	}
+      } catch (std::exception& ex) {
+	std::cerr << "Could not load colour transform from \"" << filepath.string() << "\": " << ex.what() << std::endl;
+      }
+    }
+
+    auto ret = std::make_shared<Transform>(input, informat, output, outformat, intent, flags);
+
+    // Save the optimised transform, writing to a temporary file first so that other processes never see half of it
+    fs::path temppath;
+    try {
+      auto link = ret->device_link(4.3, 0);
+      if ((cmsHPROFILE)*link == nullptr)
+	return ret;
+
+      fs::create_directories(disk_cache_dir);
+      unsigned char *data;
+      unsigned int size;
+      link->save_to_mem(data, size);
+      if (data == nullptr)
+	return ret;
+
+      temppath = disk_cache_dir / fs::unique_path("%%%%-%%%%-%%%%.tmp");
+      bool written;
+      {
+	fs::ofstream ofs(temppath, std::ios_base::out | std::ios_base::binary);
+	ofs.write((const char*)data, size);
+	ofs.close();
+	written = !ofs.fail();
+      }
+      delete [] data;
+      if (!written)
+	throw std::runtime_error("could not write " + temppath.string());
+      fs::rename(temppath, filepath);
+    } catch (std::exception& ex) {
+      std::cerr << "Could not save colour transform to \"" << filepath.string() << "\": " << ex.what() << std::endl;
+      boost::system::error_code ec;
+      if (!temppath.empty())
+	fs::remove(temppath, ec);
+    }
+
+    return ret;
+  }
+
+  Transform::ptr Transform::create(Profile::ptr input, const Format &informat,
+				   Profile::ptr output, const Format &outformat,
+				   Intent intent, cmsUInt32Number flags) {
+    // Also used as the file name in disk_cache_dir
+    std::ostringstream oss;
+    oss << std::hex << input->hash() << "-" << (cmsUInt32Number)informat << "-"
+	<< output->hash() << "-" << (cmsUInt32Number)outformat << "-" << (int)intent << "-" << flags;
+    std::string key = oss.str();
+
+    {
+      std::lock_guard<std::mutex> lock(_cache_lock);
+      for (auto it = _cache.begin(); it != _cache.end(); it++)
+	if (it->first == key) {
+	  _cache.splice(_cache.begin(), _cache, it);
+	  _cache_hits++;
+	  return _cache.front().second;
+	}
+    }
+
+    _cache_misses++;
+    auto ret = _build(input, informat, output, outformat, intent, flags, key);
+
+    std::lock_guard<std::mutex> lock(_cache_lock);
+    // Another thread may have built the same transform in the meantime
+    for (auto it = _cache.begin(); it != _cache.end(); it++)
+      if (it->first == key) {
+	_cache.splice(_cache.begin(), _cache, it);
+	return _cache.front().second;
+      }
+
+    _cache.emplace_front(key, ret);
+    while (_cache.size() > cache_size)
+      _cache.pop_back();
+
+    return ret;
+  }
+
   Transform::ptr Transform::Proofing(Profile::ptr input, const Format &informat,
 				     Profile::ptr output, const Format &outformat,
 				     Profile::ptr proofing,
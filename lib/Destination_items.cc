@@ -40,9 +40,30 @@ namespace PhotoFinish {
     if (node["sigma"])
       _sigma = node["sigma"].as<double>();
 
+    if (node["method"])
+      _method = node["method"].as<std::string>();
+
+    if (node["amount"])
+      _amount = node["amount"].as<double>();
+
+    if (node["luminance"])
+      _luminance = node["luminance"].as<bool>();
+
     set_defined();
   }
 
+  std::ostream& operator<< (std::ostream& out, const D_sharpen& ds) {
+    out << "sharpen(radius=" << ds._radius << ", sigma=" << ds._sigma;
+    if (ds._method.length() > 0)
+      out << ", method=" << ds._method;
+    if (ds._amount.defined())
+      out << ", amount=" << ds._amount;
+    if (ds._luminance.defined() && ds._luminance)
+      out << ", luminance";
+    out << ")";
+    return out;
+  }
+
 
 
   D_resize::D_resize()
@@ -60,9 +81,25 @@ namespace PhotoFinish {
     if (node["support"])
       _support = node["support"].as<double>();
 
+    if (node["integer"])
+      _integer = node["integer"].as<bool>();
+
+    if (node["prereduce"])
+      _prereduce = node["prereduce"].as<double>();
+
     set_defined();
   }
 
+  std::ostream& operator<< (std::ostream& out, const D_resize& dr) {
+    out << "resize(filter=" << dr._filter << ", support=" << dr._support;
+    if (dr._integer.defined() && dr._integer)
+      out << ", integer";
+    if (dr._prereduce.defined())
+      out << ", prereduce=" << dr._prereduce;
+    out << ")";
+    return out;
+  }
+
 
 
   D_target::D_target(const std::string& n, double w, double h) :
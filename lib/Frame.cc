@@ -18,10 +18,15 @@
 */
 #include <iostream>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <math.h>
 #include <omp.h>
 #include "Frame.hh"
 #include "Destination_items.hh"
 #include "Kernel1Dvar.hh"
+#include "Kernel2D.hh"
+#include "Benchmark.hh"
 
 namespace PhotoFinish {
 
@@ -37,17 +42,237 @@ namespace PhotoFinish {
     _crop_w(w), _crop_h(h)
   {}
 
+  // Average blocks of kx × ky pixels of the area starting at (x, y), blocks at the right and bottom edges may be smaller
+  template <typename T>
+  static void box_reduce_type(Image::ptr src, Image::ptr dest, unsigned int x, unsigned int y, unsigned int kx, unsigned int ky, bool can_free) {
+    const unsigned int channels = src->format().total_channels();
+    const unsigned int width = dest->width(), height = dest->height();
+    const size_t row_values = (size_t)width * channels;
+    for (unsigned int ny = 0; ny < height; ny++)
+      dest->check_row_alloc(ny);
+
+#pragma omp parallel
+    {
+      std::vector<SAMPLE> sums(row_values);
+
+#pragma omp for schedule(dynamic, 1)
+      for (unsigned int ny = 0; ny < height; ny++) {
+	unsigned int top = y + (ny * ky);
+	unsigned int rows = std::min(ky, src->height() - top);
+	for (size_t i = 0; i < row_values; i++)
+	  sums[i] = 0;
+
+	for (unsigned int r = 0; r < rows; r++) {
+	  const T *in = src->row_data<T>(top + r) + ((size_t)x * channels);
+	  SAMPLE *sum = sums.data();
+	  for (unsigned int nx = 0; nx < width; nx++, sum += channels) {
+	    unsigned int cols = std::min(kx, src->width() - (x + (nx * kx)));
+	    for (unsigned int k = 0; k < cols; k++)
+	      for (unsigned int c = 0; c < channels; c++, in++)
+		sum[c] += *in;
+	  }
+	  if (can_free)
+	    src->free_row(top + r);
+	}
+
+	T *out = dest->write_row_data<T>(ny);
+	const SAMPLE *sum = sums.data();
+	for (unsigned int nx = 0; nx < width; nx++) {
+	  unsigned int cols = std::min(kx, src->width() - (x + (nx * kx)));
+	  SAMPLE scale = 1.0 / (rows * cols);
+	  for (unsigned int c = 0; c < channels; c++, sum++, out++)
+	    *out = limitval<T>(*sum * scale);
+	}
+      }
+    }
+  }
+
+  //! Average blocks of pixels of part of an image
+  static Image::ptr box_reduce(Image::ptr img, unsigned int x, unsigned int y, unsigned int w, unsigned int h, unsigned int kx, unsigned int ky, bool can_free) {
+    auto ni = std::make_shared<Image>((w + kx - 1) / kx, (h + ky - 1) / ky, img->format());
+    ni->set_profile(img->profile());
+    if (img->xres().defined())
+      ni->set_xres(img->xres() / kx);
+    if (img->yres().defined())
+      ni->set_yres(img->yres() / ky);
+
+    img->generate_all();
+    std::cerr << "Box-reducing image " << w << "x" << h << " => " << ni->width() << "x" << ni->height() << "..." << std::endl;
+
+    Timer timer;
+    timer.start();
+    switch (img->format().bytes_per_channel()) {
+    case 1:
+      box_reduce_type<unsigned char>(img, ni, x, y, kx, ky, can_free);
+      break;
+
+    case 2:
+      if (img->format().is_fp())
+	box_reduce_type<half>(img, ni, x, y, kx, ky, can_free);
+      else
+	box_reduce_type<short unsigned int>(img, ni, x, y, kx, ky, can_free);
+      break;
+
+    case 4:
+      if (img->format().is_fp())
+	box_reduce_type<float>(img, ni, x, y, kx, ky, can_free);
+      else
+	box_reduce_type<unsigned int>(img, ni, x, y, kx, ky, can_free);
+      break;
+
+    case 8:
+      box_reduce_type<double>(img, ni, x, y, kx, ky, can_free);
+      break;
+
+    }
+    timer.stop();
+
+    if (benchmark_mode) {
+      long long pixel_count = (long long)w * h;
+      std::cerr << std::setprecision(2) << std::fixed;
+      std::cerr << "Benchmark: Box-reduced " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second" << std::endl;
+    }
+
+    return ni;
+  }
+
+  // Whole blocks of k pixels covering 'size' pixels from 'start', moved back from the edge of the image if needed
+  // so that the last block isn't a partial one, whose centre would be out of step with the rest
+  static void block_window(double start, double size, unsigned int max, unsigned int k, unsigned int& first, unsigned int& length) {
+    first = floor(start);
+    unsigned int end = std::min((unsigned int)ceil(start + size), max);
+    length = std::min(((end - first + k - 1) / k) * k, max);
+    if (first + length > max)
+      first = max - length;
+  }
+
   Image::ptr Frame::crop_resize(Image::ptr img, const D_resize& dr, bool can_free) {
+    if (dr.prereduce().defined()) {
+      // Whole factors that leave between half of the tolerance and the tolerance to the filter
+      double tolerance = dr.prereduce();
+      if (tolerance < 2)
+	tolerance = 2;
+      unsigned int kx = ceil((_crop_w / _width) / tolerance);
+      unsigned int ky = ceil((_crop_h / _height) / tolerance);
+      if ((kx > 1) || (ky > 1)) {
+	// Only the blocks under the crop window
+	unsigned int x, y, w, h;
+	block_window(_crop_x, _crop_w, img->width(), kx, x, w);
+	block_window(_crop_y, _crop_h, img->height(), ky, y, h);
+	auto reduced = box_reduce(img, x, y, w, h, kx, ky, can_free);
+
+	// Each reduced pixel sits at the centre of its block
+	Frame frame(_width, _height,
+		    (_crop_x - x - ((kx - 1) * 0.5)) / kx, (_crop_y - y - ((ky - 1) * 0.5)) / ky,
+		    _crop_w / kx, _crop_h / ky);
+	return frame.crop_resize(reduced, D_resize(dr).clear_prereduce(), true);
+      }
+    }
+
+    auto scale_width = Kernel1Dvar::create(dr, _crop_x, _crop_w, img->width(), _width);
+    auto scale_height = Kernel1Dvar::create(dr, _crop_y, _crop_h, img->height(), _height);
+
+    return Kernel1Dvar::convolve_hv(scale_width, scale_height, img, can_free);
+  }
+
+  Image::ptr Frame::crop_resize_sharpen(Image::ptr img, const D_resize& dr, std::shared_ptr<Kernel2D> sharpen, bool can_free) {
+    if (dr.prereduce().defined() || !sharpen->is_windowed())
+      return sharpen->convolve(crop_resize(img, dr, can_free), true);
+
+    auto scale_width = Kernel1Dvar::create(dr, _crop_x, _crop_w, img->width(), _width);
+    auto scale_height = Kernel1Dvar::create(dr, _crop_y, _crop_h, img->height(), _height);
+
+    Image::ptr sharpened;
+    std::shared_ptr<RowReleaser> releaser;
+    unsigned int done = 0;
+    Timer timer;
+    long long sharpen_ns = 0;
+    Kernel1Dvar::convolve_hv(scale_width, scale_height, img, can_free,
+			     [&](Image::ptr resized, unsigned int available) {
+	if (!sharpened) {
+	  sharpened = std::make_shared<Image>(resized->width(), resized->height(), resized->format());
+	  sharpened->set_profile(resized->profile());
+	  if (resized->xres().defined())
+	    sharpened->set_xres(resized->xres());
+	  if (resized->yres().defined())
+	    sharpened->set_yres(resized->yres());
+	  releaser = std::make_shared<RowReleaser>(resized, resized->height());
+	}
+
+	unsigned int height = resized->height(), last = done;
+	while ((last < height) && (sharpen->last_row_needed(last, height) < available))
+	  last++;
+	if (last == done)
+	  return;
+
+	for (unsigned int y = done; y < last; y++)
+	  sharpened->check_row_alloc(y);
+	timer.start();
+	sharpen->convolve_rows(resized, sharpened, done, last, releaser.get());
+	timer.stop();
+	sharpen_ns += timer.elapsed_ns();
+	done = last;
+      });
+
+    if (benchmark_mode && (sharpen_ns > 0)) {
+      long long pixel_count = (long long)sharpened->width() * sharpened->height();
+      std::cerr << std::setprecision(2) << std::fixed;
+      std::cerr << "Benchmark: Sharpened " << pixel_count << " pixels as they were resized in " << (sharpen_ns / 1e+6) << " ms = "
+		<< (pixel_count * 1e+3 / sharpen_ns) << " Mpixels/second" << std::endl;
+    }
+
+    return sharpened;
+  }
+
+  std::vector<Image::ptr> Frame::crop_resize_many(Image::ptr img, const std::vector<Frame::ptr>& frames, const std::vector<D_resize>& resizes, bool can_free) {
+    std::vector<Image::ptr> results(frames.size());
+    std::vector<unsigned int> shared, separate;
+    for (unsigned int i = 0; i < frames.size(); i++)
+      if ((resizes[i].integer().defined() && resizes[i].integer()) || resizes[i].prereduce().defined())
+	separate.push_back(i);
+      else
+	shared.push_back(i);
+
+    if (shared.size() > 1) {
+      std::vector<Kernel1Dvar::ptr> h_kernels, v_kernels;
+      std::vector<unsigned int> first, last;
+      for (auto i : shared) {
+	auto frame = frames[i];
+	h_kernels.push_back(Kernel1Dvar::create(resizes[i], frame->_crop_x, frame->_crop_w, img->width(), frame->_width));
+	auto v_kernel = Kernel1Dvar::create(resizes[i], frame->_crop_y, frame->_crop_h, img->height(), frame->_height);
+	unsigned int end = ceil(frame->_height) - 1;
+	first.push_back(v_kernel->start(0));
+	last.push_back(v_kernel->start(end) + v_kernel->size(end));
+	v_kernels.push_back(v_kernel);
+      }
+
+      auto temps = Kernel1Dvar::convolve_h_many(img, h_kernels, first, last, can_free && separate.empty());
+      for (unsigned int j = 0; j < shared.size(); j++) {
+	results[shared[j]] = v_kernels[j]->convolve_v(temps[j], true);
+	temps[j].reset();
+      }
+    } else
+      separate.insert(separate.end(), shared.begin(), shared.end());
+
+    for (unsigned int j = 0; j < separate.size(); j++) {
+      unsigned int i = separate[j];
+      results[i] = frames[i]->crop_resize(img, resizes[i], can_free && (j + 1 == separate.size()));
+    }
+
+    return results;
+  }
+
+  Image::ptr Frame::crop_resize_lazy(Image::ptr img, const D_resize& dr, bool can_free) {
     auto scale_width = Kernel1Dvar::create(dr, _crop_x, _crop_w, img->width(), _width);
     auto scale_height = Kernel1Dvar::create(dr, _crop_y, _crop_h, img->height(), _height);
 
     if (_width * img->height() < img->width() * _height) {
-      auto temp = scale_width->convolve_h(img, can_free);
-      return scale_height->convolve_v(temp, true);
+      auto temp = scale_width->convolve_h_lazy(img, can_free);
+      return scale_height->convolve_v_lazy(temp);
     }
 
-    auto temp = scale_height->convolve_v(img, can_free);
-    return scale_width->convolve_h(temp, true);
+    auto temp = scale_height->convolve_v_lazy(img, can_free);
+    return scale_width->convolve_h_lazy(temp);
   }
 
   const double Frame::waste(Image::ptr img) const {
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <omp.h>
+#include <boost/algorithm/string/predicate.hpp>
 #include "Image.hh"
 #include "ImageFile.hh"
 #include "Benchmark.hh"
@@ -32,9 +33,11 @@ namespace PhotoFinish {
     _height(h),
     _format(f),
     _row_size(0),
-    _rows(h, nullptr)
+    _rows(h, nullptr),
+    _next_row(h)
   {
     _calc_sizes();
+    _make_slabs();
   }
 
   void Image::_calc_sizes(void) {
@@ -50,10 +53,88 @@ namespace PhotoFinish {
     }
   }
 
+  void Image::_make_slabs(void) {
+    // Round the row size up so that every row in a slab starts on a cache line
+    _row_stride = (_row_size + ImageSlab::row_alignment - 1) & ~(ImageSlab::row_alignment - 1);
+    if (_row_stride == 0)
+      _row_stride = ImageSlab::row_alignment;
+
+    _slab_rows = ImageSlab::target_size / _row_stride;
+    if (_slab_rows < 1)
+      _slab_rows = 1;
+    if (_slab_rows > _height)
+      _slab_rows = _height;
+
+    bool file_backed = ImageSlab::want_files((size_t)_height * _row_stride);
+    if (file_backed)
+      std::cerr << "Keeping " << format_byte_size((size_t)_height * _row_stride) << " of image data in temporary files." << std::endl;
+
+    _slabs.clear();
+    for (unsigned int y = 0; y < _height; y += _slab_rows) {
+      unsigned int num_rows = _height - y < _slab_rows ? _height - y : _slab_rows;
+      _slabs.push_back(std::make_shared<ImageSlab>(num_rows * _row_stride, file_backed));
+    }
+  }
+
+  ImageRow::ptr Image::_new_row(unsigned int y) {
+    // The format may have changed since the slabs were laid out
+    if (_row_size > _row_stride)
+      return std::make_shared<ImageRow>(this, y);
+
+    return std::make_shared<ImageRow>(this, y, _slabs[y / _slab_rows], (y % _slab_rows) * _row_stride);
+  }
+
   Image::~Image() {
     _rows.clear();
   }
 
+  unsigned int RowGenerator::block_rows(void) {
+    return 2 * omp_get_max_threads();
+  }
+
+  void Image::set_generator(RowGenerator::ptr gen) {
+    std::lock_guard<std::mutex> lock(_generator_lock);
+    _generator = gen;
+    _next_row.store(0, std::memory_order_release);
+  }
+
+  void Image::_generate(unsigned int y) const {
+    std::lock_guard<std::mutex> lock(_generator_lock);
+    // Another thread may have produced the row while we waited for the lock
+    unsigned int next = _next_row.load(std::memory_order_acquire);
+    if ((y < next) || (next >= _height))
+      return;
+
+    // The generator fills in rows of this image, so it needs a non-const reference
+    Image& self = const_cast<Image&>(*this);
+    unsigned int block = RowGenerator::block_rows();
+    if (y >= _height)
+      y = _height - 1;
+    while (next <= y) {
+      unsigned int last = next + block < _height ? next + block : _height;
+      _generator->generate(self, next, last);
+      next = last;
+      _next_row.store(next, std::memory_order_release);
+    }
+
+    // Drop the generator (and the images it holds on to) once it is done
+    if (next >= _height)
+      self._generator.reset();
+  }
+
+  ImageView::ImageView(const Image& img, unsigned int first, unsigned int last) :
+    _first(first),
+    _rows(last > first ? last - first : 0, nullptr),
+    _pixel_size(img.pixel_size()),
+    _plane_size(img.plane_size())
+  {
+    for (unsigned int y = first; y < last; y++) {
+      auto row = img.row(y);
+      if (row)
+	_rows[y - first] = row->data();
+    }
+  }
+
   CMS::Profile::ptr Image::default_profile(CMS::ColourModel default_colourmodel, std::string for_desc) {
     switch (default_colourmodel) {
     case CMS::ColourModel::RGB:
@@ -78,6 +159,39 @@ namespace PhotoFinish {
     return std::make_shared<CMS::Profile>();
   }
 
+  Precision Image::intermediate_precision = Precision::Sample;
+
+  CMS::Format Image::intermediate_format(unsigned int extra_channels) {
+    CMS::Format format;
+    format.set_colour_model(CMS::ColourModel::Lab);
+    switch (intermediate_precision) {
+    case Precision::Half:
+      format.set_half();
+      break;
+
+    case Precision::Fixed16:
+      format.set_16bit();
+      break;
+
+    default:
+      SET_SAMPLE_FORMAT(format);
+    }
+    format.set_extra_channels(extra_channels);
+    return format;
+  }
+
+  bool parse_precision(const std::string& name, Precision& precision) {
+    if (boost::iequals(name, "float") || boost::iequals(name, "sample"))
+      precision = Precision::Sample;
+    else if (boost::iequals(name, "half"))
+      precision = Precision::Half;
+    else if (boost::iequals(name, "16bit") || boost::iequals(name, "16"))
+      precision = Precision::Fixed16;
+    else
+      return false;
+    return true;
+  }
+
   void Image::replace_row(std::shared_ptr<ImageRow> newrow) {
     if (newrow->_image == this)
       _rows[newrow->_y] = newrow;
@@ -101,7 +215,10 @@ namespace PhotoFinish {
       break;
 
     case 2:
-      transfer_alpha_typed2<A, short unsigned int>(width, src_channels, src_row, dest_channels,(short unsigned int*)dest_row);
+      if (dest_format.is_fp())
+	transfer_alpha_typed2<A, half>(width, src_channels, src_row, dest_channels,(half*)dest_row);
+      else
+	transfer_alpha_typed2<A, short unsigned int>(width, src_channels, src_row, dest_channels,(short unsigned int*)dest_row);
       break;
 
     case 4:
@@ -127,7 +244,10 @@ namespace PhotoFinish {
       break;
 
     case 2:
-      transfer_alpha_typed<short unsigned int>(width, src_channels, (short unsigned int*)src_row, dest_format, dest_row);
+      if (src_format.is_fp())
+	transfer_alpha_typed<half>(width, src_channels, (half*)src_row, dest_format, dest_row);
+      else
+	transfer_alpha_typed<short unsigned int>(width, src_channels, (short unsigned int*)src_row, dest_format, dest_row);
       break;
 
     case 4:
@@ -144,6 +264,43 @@ namespace PhotoFinish {
   }
 
   void ImageRow::transform_colour(CMS::Transform::ptr transform, ImageRow::ptr dest_row) {
+    // LCMS2 doesn't handle half floats well, so the transform works on floats
+    // and half rows are widened before and narrowed after.
+    if (!transform->one_is_planar() && (format().is_half() || dest_row->format().is_half())) {
+      size_t width = _image->width();
+      size_t in_values = width * format().total_channels(), out_values = width * dest_row->format().total_channels();
+      const unsigned char *input = _data;
+      unsigned char *output = dest_row->_data;
+
+      float *wide_in = nullptr, *wide_out = nullptr;
+      if (format().is_half()) {
+	wide_in = (float*)RowBufferPool::acquire(in_values * sizeof(float));
+	const half *in = (const half*)_data;
+	for (size_t i = 0; i < in_values; i++)
+	  wide_in[i] = in[i];
+	input = (const unsigned char*)wide_in;
+      }
+      if (dest_row->format().is_half()) {
+	wide_out = (float*)RowBufferPool::acquire(out_values * sizeof(float));
+	output = (unsigned char*)wide_out;
+      }
+
+      transform->transform_buffer(input, output, width);
+
+      if (wide_out != nullptr) {
+	half *out = (half*)dest_row->_data;
+	for (size_t i = 0; i < out_values; i++)
+	  out[i] = wide_out[i];
+	RowBufferPool::release((unsigned char*)wide_out, out_values * sizeof(float));
+      }
+      if (wide_in != nullptr)
+	RowBufferPool::release((unsigned char*)wide_in, in_values * sizeof(float));
+
+      if (dest_row->format().extra_channels())
+	transfer_alpha(_image->width(), _image->format(), _data, dest_row->format(), dest_row->_data);
+      return;
+    }
+
     if (transform->one_is_planar())
       transform->transform_buffer_planar(_data, dest_row->_data,
 					 _image->width(), 1,
@@ -162,7 +319,72 @@ namespace PhotoFinish {
     return profile->description("en", "");
   }
 
+  //! Produces the rows of a colour-transformed image from the rows of a source image
+  class ColourTransformer : public RowGenerator {
+  private:
+    Image::ptr _src;
+    CMS::Transform::ptr _transform;
+    bool _need_un_alpha_mult, _need_alpha_mult;
+    CMS::Format _orig_dest_format;
+
+  public:
+    ColourTransformer(Image::ptr src, CMS::Transform::ptr transform, bool need_un_alpha_mult, bool need_alpha_mult, CMS::Format orig_dest_format) :
+      _src(src),
+      _transform(transform),
+      _need_un_alpha_mult(need_un_alpha_mult), _need_alpha_mult(need_alpha_mult),
+      _orig_dest_format(orig_dest_format)
+    {}
+
+    void generate(Image& dest, unsigned int first, unsigned int last) {
+      _src->check_row_generated(last - 1);
+      _src->_transform_rows(_transform, dest.shared_from_this(), first, last,
+			    _need_un_alpha_mult, _need_alpha_mult, _orig_dest_format, true);
+    }
+
+  }; // class ColourTransformer
+
+  void Image::_transform_rows(CMS::Transform::ptr transform, ptr dest, unsigned int first, unsigned int last,
+			      bool need_un_alpha_mult, bool need_alpha_mult, CMS::Format orig_dest_format, bool can_free) {
+    bool show_progress = !dest->is_lazy();
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int y = first; y < last; y++) {
+      dest->check_row_alloc(y);
+      ImageRow::ptr src_row = _rows[y], dest_row = dest->_rows[y];
+
+      if (need_un_alpha_mult) {
+	auto temp = src_row->empty_copy();
+	src_row->_un_alpha_mult(temp);
+	src_row = temp;
+	replace_row(temp);
+      }
+
+      src_row->transform_colour(transform, dest_row);
+
+      if (need_alpha_mult) {
+	auto temp = dest_row->empty_copy();
+	dest_row->_alpha_mult(orig_dest_format, temp);
+	dest_row = temp;
+	dest->replace_row(temp);
+      }
+
+      if (can_free)
+	this->free_row(y);
+
+      if (show_progress && (omp_get_thread_num() == 0))
+	std::cerr << "\r\tTransformed " << y + 1 << " of " << _height << " rows";
+    }
+  }
+
   Image::ptr Image::transform_colour(CMS::Profile::ptr dest_profile, CMS::Format dest_format, CMS::Intent intent, bool can_free) {
+    return _transform_colour(dest_profile, dest_format, intent, can_free, false);
+  }
+
+  Image::ptr Image::transform_colour_lazy(CMS::Profile::ptr dest_profile, CMS::Format dest_format, CMS::Intent intent) {
+    return _transform_colour(dest_profile, dest_format, intent, true, true);
+  }
+
+  Image::ptr Image::_transform_colour(CMS::Profile::ptr dest_profile, CMS::Format dest_format, CMS::Intent intent, bool can_free, bool lazy) {
     CMS::Profile::ptr profile = _profile;
     if (!_profile)
       profile = default_profile(_format, "source");
@@ -182,52 +404,41 @@ namespace PhotoFinish {
       }
     }
 
-#pragma omp parallel
-    {
-#pragma omp master
-      {
-	std::cerr << "Transforming colour from \"" << profile_name(profile) << "\" (" << _format << ") to \"" << profile_name(dest_profile) << "\" (" << dest_format << ") using " << omp_get_num_threads() << " threads..." << std::endl;
-      }
-    }
+    // Half float rows are widened to float for LCMS2, see ImageRow::transform_colour()
+    CMS::Format transform_format = _format, transform_dest_format = dest_format;
+    if (transform_format.is_half() && !transform_format.is_planar())
+      transform_format.set_float();
+    if (transform_dest_format.is_half() && !transform_dest_format.is_planar())
+      transform_dest_format.set_float();
 
-    auto transform = std::make_shared<CMS::Transform>(profile, _format,
-						      dest_profile, dest_format,
-						      intent, cmsFLAGS_NOCACHE);
+    auto transform = CMS::Transform::create(profile, transform_format,
+					    dest_profile, transform_dest_format,
+					    intent, cmsFLAGS_NOCACHE);
 
     auto dest = std::make_shared<Image>(_width, _height, dest_format);
     dest->set_profile(dest_profile);
     dest->set_resolution(_xres, _yres);
 
-    Timer timer;
-    timer.start();
-
-#pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int y = 0; y < _height; y++) {
-      dest->check_row_alloc(y);
-      ImageRow::ptr src_row = row(y), dest_row = dest->row(y);
-
-      if (need_un_alpha_mult) {
-	auto temp = src_row->empty_copy();
-	src_row->_un_alpha_mult(temp);
-	src_row = temp;
-	replace_row(temp);
-      }
+    if (lazy) {
+      std::cerr << "Transforming colour from \"" << profile_name(profile) << "\" (" << _format << ") to \"" << profile_name(dest_profile) << "\" (" << dest_format << ") as rows are needed." << std::endl;
+      dest->set_generator(std::make_shared<ColourTransformer>(shared_from_this(), transform,
+								need_un_alpha_mult, need_alpha_mult, orig_dest_format));
+      return dest;
+    }
 
-      src_row->transform_colour(transform, dest_row);
+    generate_all();
 
-      if (need_alpha_mult) {
-	auto temp = dest_row->empty_copy();
-	dest_row->_alpha_mult(orig_dest_format, temp);
-	dest_row = temp;
-	dest->replace_row(temp);
+#pragma omp parallel
+    {
+#pragma omp master
+      {
+	std::cerr << "Transforming colour from \"" << profile_name(profile) << "\" (" << _format << ") to \"" << profile_name(dest_profile) << "\" (" << dest_format << ") using " << omp_get_num_threads() << " threads..." << std::endl;
       }
-
-      if (can_free)
-	this->free_row(y);
-
-      if (omp_get_thread_num() == 0)
-	std::cerr << "\r\tTransformed " << y + 1 << " of " << _height << " rows";
     }
+
+    Timer timer;
+    timer.start();
+    _transform_rows(transform, dest, 0, _height, need_un_alpha_mult, need_alpha_mult, orig_dest_format, can_free);
     timer.stop();
     std::cerr << "\r\tTransformed " << _height << " of " << _height << " rows." << std::endl;
 
@@ -278,6 +489,8 @@ namespace PhotoFinish {
 	_un_alpha_mult_src<unsigned char>(dest_row);
       else if (format().is_16bit())
 	_un_alpha_mult_src<short unsigned int>(dest_row);
+      else if (format().is_half())
+	_un_alpha_mult_src<half>(dest_row);
       else if (format().is_32bit())
 	_un_alpha_mult_src<unsigned int>(dest_row);
       else if (format().is_float())
@@ -320,6 +533,8 @@ namespace PhotoFinish {
       _alpha_mult_src_dst<SRC, unsigned char>(dest_format, dest_row);
     else if (dest_format.is_16bit())
       _alpha_mult_src_dst<SRC, short unsigned int>(dest_format, dest_row);
+    else if (dest_format.is_half())
+      _alpha_mult_src_dst<SRC, half>(dest_format, dest_row);
     else if (dest_format.is_32bit())
       _alpha_mult_src_dst<SRC, unsigned int>(dest_format, dest_row);
     else if (dest_format.is_float())
@@ -334,6 +549,8 @@ namespace PhotoFinish {
 	_alpha_mult_src<unsigned char>(dest_format, dest_row);
       else if (format().is_16bit())
 	_alpha_mult_src<short unsigned int>(dest_format, dest_row);
+      else if (format().is_half())
+	_alpha_mult_src<half>(dest_format, dest_row);
       else if (format().is_32bit())
 	_alpha_mult_src<unsigned int>(dest_format, dest_row);
       else if (format().is_float())
@@ -16,6 +16,7 @@
 	You should have received a copy of the GNU General Public License
 	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <iostream>
 #include <sstream>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem.hpp>
@@ -26,6 +27,8 @@ namespace fs = boost::filesystem;
 
 namespace PhotoFinish {
 
+  std::mutex exiv2_mutex;
+
   ImageFilepath::ImageFilepath(const fs::path filepath, const std::string format) :
     _filepath(filepath),
     _format(format)
@@ -169,6 +172,7 @@ namespace PhotoFinish {
     if (_is_open)
       throw FileOpenError("already open");
 
+    std::lock_guard<std::mutex> lock(exiv2_mutex);
     Exiv2::Image::AutoPtr imagefile = Exiv2::ImageFactory::open(_filepath.native());
     assert(imagefile.get() != 0);
     imagefile->readMetadata();
@@ -241,16 +245,32 @@ namespace PhotoFinish {
     return this->read(temp);
   }
 
+  Image::ptr ImageReader::read_lazy(void) {
+    auto temp = std::make_shared<Destination>();
+    return this->read_lazy(temp);
+  }
+
+  Image::ptr ImageReader::read_lazy(Destination::ptr dest) {
+    return this->read(dest);
+  }
+
 
   ImageWriter::ImageWriter(const fs::path fp) :
     _filepath(fp),
-    _is_open(false)
+    _is_open(false),
+    _defer_tags(false), _tags_deferred(false)
   {}
 
   void ImageWriter::embed_tags(Image::ptr img) const {
     if (_is_open)
       throw FileOpenError("already open");
 
+    if (_defer_tags) {
+      _tags_deferred = true;
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(exiv2_mutex);
     Exiv2::Image::AutoPtr imagefile = Exiv2::ImageFactory::open(_filepath.native());
     assert(imagefile.get() != 0);
 
@@ -260,6 +280,15 @@ namespace PhotoFinish {
     imagefile->writeMetadata();
   }
 
+  void ImageWriter::embed_deferred_tags(Image::ptr img) const {
+    if (!_tags_deferred)
+      return;
+
+    std::cerr << "Embedding tags in " << _filepath << "..." << std::endl;
+    _defer_tags = _tags_deferred = false;
+    embed_tags(img);
+  }
+
   ImageWriter::ptr ImageWriter::open(const ImageFilepath& ifp) {
     ImageWriter *iw = nullptr;
 #ifdef HAZ_PNG
@@ -365,4 +394,27 @@ namespace PhotoFinish {
     return ss.str();
   }
 
+  bool parse_byte_size(const std::string& text, uint64_t& bytes) {
+    char *end;
+    double value = strtod(text.c_str(), &end);
+    if ((end == text.c_str()) || (value < 0))
+      return false;
+
+    std::string suffix(end);
+    if (suffix.length() > 0) {
+      size_t si = std::string("kmgtpe").find(tolower(suffix[0]));
+      if (si == std::string::npos)
+	return false;
+      // Accept "k", "kB", "kiB", etc. but always use powers of two
+      std::string rest = suffix.substr(1);
+      if ((rest.length() > 0) && !boost::iequals(rest, "b") && !boost::iequals(rest, "ib"))
+	return false;
+      for (size_t i = 0; i <= si; i++)
+	value *= 1024;
+    }
+
+    bytes = value;
+    return true;
+  }
+
 }
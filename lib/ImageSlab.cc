@@ -0,0 +1,212 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ImageSlab.hh"
+#include "MemoryBudget.hh"
+#include "ImageFile.hh"
+#include "Exception.hh"
+
+namespace PhotoFinish {
+
+  bool ImageSlab::use_huge_pages = false;
+  bool ImageSlab::use_files = false;
+
+  static size_t half_physical_memory(void) {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if ((pages <= 0) || (page_size <= 0))
+      return 0;
+    return (size_t)pages * page_size / 2;
+  }
+
+  size_t ImageSlab::file_threshold = half_physical_memory();
+
+  static std::string default_temp_dir(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir != nullptr)
+      return dir;
+    return "/var/tmp";
+  }
+
+  std::string ImageSlab::temp_dir = default_temp_dir();
+
+  size_t ImageSlab::max_spare = 256 << 20;
+
+  // Mappings kept for reuse after their slabs were unmapped
+  struct SpareMapping {
+    unsigned char *data;
+    size_t size;
+  };
+  static std::vector<SpareMapping> spares;
+  static size_t spare_size = 0;
+  static std::mutex spare_lock;
+
+  // Transparent huge pages are 2 MiB on x86-64 and most other platforms
+  static const size_t huge_page_size = 2 << 20;
+
+  ImageSlab::ImageSlab(size_t size, bool file_backed) :
+    _size(size),
+    _file_backed(file_backed),
+    _data(nullptr),
+    _live_rows(0)
+  {
+    if (use_huge_pages && !_file_backed)
+      _size = (_size + huge_page_size - 1) & ~(huge_page_size - 1);
+    _chunk_rows.resize((_size + chunk_size - 1) / chunk_size, 0);
+  }
+
+  ImageSlab::~ImageSlab() {
+    _unmap();
+  }
+
+  bool ImageSlab::want_files(size_t image_size) {
+    return use_files || ((file_threshold > 0) && (image_size >= file_threshold));
+  }
+
+  void ImageSlab::_map_file(void) {
+    std::string filename = temp_dir + "/photofinish-XXXXXX";
+    int fd = mkstemp(&filename[0]);
+    if (fd < 0)
+      throw MemAllocError("Could not create temporary file \"" + filename + "\" for image data.");
+    // Nothing else needs the name, and the space is given back when the mapping goes
+    unlink(filename.c_str());
+
+    if (ftruncate(fd, _size) != 0) {
+      close(fd);
+      throw MemAllocError("Could not make " + format_byte_size(_size) + " temporary file for image data.");
+    }
+
+    void *addr = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      throw MemAllocError("Could not map " + format_byte_size(_size) + " temporary file for image data.");
+
+    _data = (unsigned char*)addr;
+    // Rows are almost always worked through from top to bottom
+    madvise(_data, _size, MADV_SEQUENTIAL);
+  }
+
+  void ImageSlab::_map(void) {
+    if (_file_backed) {
+      _map_file();
+      return;
+    }
+
+    {
+      // Images made one after the other usually have slabs of the same size
+      std::lock_guard<std::mutex> lock(spare_lock);
+      for (auto si = spares.begin(); si != spares.end(); si++)
+	if (si->size == _size) {
+	  _data = si->data;
+	  spare_size -= _size;
+	  spares.erase(si);
+	  return;
+	}
+    }
+
+    size_t map_size = _size;
+    if (use_huge_pages)
+      map_size += huge_page_size;
+
+    void *addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+      throw MemAllocError("Could not map " + format_byte_size(map_size) + " for image data.");
+
+    _data = (unsigned char*)addr;
+    if (use_huge_pages) {
+      // Trim the mapping so that it starts and ends on a huge page boundary
+      unsigned char *aligned = (unsigned char*)(((uintptr_t)addr + huge_page_size - 1) & ~(uintptr_t)(huge_page_size - 1));
+      size_t head = aligned - _data;
+      if (head > 0)
+	munmap(_data, head);
+      if (map_size - head > _size)
+	munmap(aligned + _size, map_size - head - _size);
+      _data = aligned;
+#ifdef MADV_HUGEPAGE
+      madvise(_data, _size, MADV_HUGEPAGE);
+#endif
+    }
+  }
+
+  void ImageSlab::_release_chunk(size_t c) {
+    _chunk_rows[c] = 0;
+    // The page cache can always write file-backed data out, so it isn't counted
+    if (_file_backed)
+      return;
+
+    madvise(_data + (c * chunk_size), _chunk_bytes(c), MADV_DONTNEED);
+    MemoryBudget::freed(_chunk_bytes(c));
+  }
+
+  void ImageSlab::_unmap(void) {
+    if (_data == nullptr)
+      return;
+
+    // Rows are normally all released by now, but a slab can be dropped while still in use
+    for (size_t c = 0; c < _chunk_rows.size(); c++)
+      if (_chunk_rows[c] > 0)
+	_release_chunk(c);
+
+    if (!_file_backed) {
+      std::lock_guard<std::mutex> lock(spare_lock);
+      if (spare_size + _size <= max_spare) {
+	spares.push_back({ _data, _size });
+	spare_size += _size;
+	_data = nullptr;
+	return;
+      }
+    }
+
+    munmap(_data, _size);
+    _data = nullptr;
+  }
+
+  unsigned char* ImageSlab::acquire_row(size_t offset, size_t length) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_data == nullptr)
+      _map();
+    _live_rows++;
+
+    size_t last = length > 0 ? (offset + length - 1) / chunk_size : offset / chunk_size;
+    for (size_t c = offset / chunk_size; c <= last; c++)
+      if ((_chunk_rows[c]++ == 0) && !_file_backed)
+	MemoryBudget::allocated(_chunk_bytes(c));
+
+    return _data + offset;
+  }
+
+  void ImageSlab::release_row(const unsigned char* row, size_t length) {
+    std::lock_guard<std::mutex> lock(_lock);
+    size_t offset = row - _data;
+    size_t last = length > 0 ? (offset + length - 1) / chunk_size : offset / chunk_size;
+    for (size_t c = offset / chunk_size; c <= last; c++)
+      if ((_chunk_rows[c] > 0) && (--_chunk_rows[c] == 0))
+	_release_chunk(c);
+
+    if (_live_rows > 0)
+      _live_rows--;
+    if (_live_rows == 0)
+      _unmap();
+  }
+
+}; // namespace PhotoFinish
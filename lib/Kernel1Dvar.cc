@@ -18,12 +18,20 @@
 */
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <new>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <type_traits>
 #include <boost/algorithm/string/predicate.hpp>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <omp.h>
 #include "Benchmark.hh"
 #include "Kernel1Dvar.hh"
+#include "SIMD.hh"
 
 #define sqr(x) ((x) * (x))
 #define min(x,y) ((x) < (y) ? (x) : (y))
@@ -32,18 +40,32 @@ namespace PhotoFinish {
 
   Kernel1Dvar::Kernel1Dvar() :
     _size(nullptr), _start(nullptr),
-    _weights(nullptr)
+    _taps(0),
+    _weights(nullptr),
+    _int_weights(nullptr)
   {}
 
   Kernel1Dvar::Kernel1Dvar(double to_size) :
     _size(nullptr), _start(nullptr),
+    _taps(0),
     _weights(nullptr),
+    _int_weights(nullptr),
     _to_size(to_size),
     _to_size_i(ceil(to_size))
   {
     _size = new unsigned int[_to_size_i];
     _start = new unsigned int[_to_size_i];
-    _weights = new SAMPLE*[_to_size_i];
+  }
+
+  // Allocate a zeroed, cache-line aligned block for the weight table
+  template <typename W>
+  static W* alloc_table(size_t count) {
+    size_t bytes = ((count * sizeof(W)) + 63) & ~(size_t)63;
+    W *table = (W*)aligned_alloc(64, bytes > 0 ? bytes : 64);
+    if (table == nullptr)
+      throw std::bad_alloc();
+    memset(table, 0, bytes);
+    return table;
   }
 
   void Kernel1Dvar::build(double from_start, double from_size, unsigned int from_max) {
@@ -54,9 +76,10 @@ namespace PhotoFinish {
       norm_fact = 1.0;
     } else {
       range = this->range() * _scale;
-      norm_fact = this->range() / ceil(range);
+      norm_fact = this->input_scale(range);
     }
 
+    // Find the window of each output pixel first, so that the table can have one padded width
 #pragma omp parallel for schedule(dynamic, 1)
     for (unsigned int i = 0; i < _to_size_i; i++) {
       double centre = from_start + (i * _scale);
@@ -68,38 +91,146 @@ namespace PhotoFinish {
 	right = from_max - 1;
       _size[i] = right + 1 - left;
       _start[i] = left;
-      _weights[i] = new SAMPLE[_size[i]];
+    }
+
+    unsigned int max_size = 0;
+    for (unsigned int i = 0; i < _to_size_i; i++)
+      if (_size[i] > max_size)
+	max_size = _size[i];
+    if (max_size <= tap_align / 2)
+      _taps = tap_align / 2;
+    else
+      _taps = ((max_size + tap_align - 1) / tap_align) * tap_align;
+    if (_taps > from_max)
+      _taps = from_max;
+
+    _weights = alloc_table<SAMPLE>((size_t)_to_size_i * _taps);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int i = 0; i < _to_size_i; i++) {
+      double centre = from_start + (i * _scale);
+      unsigned int left = _start[i], right = left + _size[i] - 1;
+
+      // Move windows near the end back so that all _taps inputs exist, the extra weights are zero
+      unsigned int shift = 0;
+      if (left + _taps > from_max) {
+	shift = left + _taps - from_max;
+	_start[i] = left - shift;
+	_size[i] += shift;
+      }
+
+      SAMPLE *weights = _weights + ((size_t)i * _taps) + shift;
       unsigned int k = 0;
       for (unsigned int j = left; j <= right; j++, k++)
-	_weights[i][k] = this->eval((centre - j) * norm_fact);
+	weights[k] = this->eval((centre - j) * norm_fact);
 
       // normalize the filter's weight's so the sum equals to 1.0, very important for avoiding box type of artifacts
-      unsigned int max = _size[i];
+      unsigned int max = right + 1 - left;
       SAMPLE tot = 0.0;
       for (unsigned int k = 0; k < max; k++)
-	tot += _weights[i][k];
+	tot += weights[k];
       if (fabs(tot) > 1e-5) {
 	tot = 1.0 / tot;
 	for (unsigned int k = 0; k < max; k++)
-	  _weights[i][k] *= tot;
+	  weights[k] *= tot;
       }
     }
   }
 
-  Kernel1Dvar::ptr Kernel1Dvar::create(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size) {
-    Kernel1Dvar::ptr ret;
-    if (dr.filter().length()  == 0) {
-      ret = std::make_shared<Lanczos1D>(D_resize::lanczos(3.0), from_start, from_size, from_max, to_size);
-      return ret;
+  double Kernel1Dvar::input_scale(double range) const {
+    return 1.0 / _scale;
+  }
+
+  void Kernel1Dvar::build_integer(void) {
+    _int_weights = alloc_table<int16_t>((size_t)_to_size_i * _taps);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int i = 0; i < _to_size_i; i++) {
+      unsigned int max = _size[i];
+      const SAMPLE *weights = _weights + ((size_t)i * _taps);
+      int16_t *int_weights = _int_weights + ((size_t)i * _taps);
+
+      // Round each weight, then make up any difference on the biggest one so
+      // that the weights still add up to exactly one
+      int32_t tot = 0;
+      unsigned int biggest = 0;
+      for (unsigned int k = 0; k < max; k++) {
+	int_weights[k] = lround(weights[k] * (1 << integer_bits));
+	tot += int_weights[k];
+	if (fabs(weights[k]) > fabs(weights[biggest]))
+	  biggest = k;
+      }
+      int_weights[biggest] += (1 << integer_bits) - tot;
     }
+  }
 
+  Kernel1Dvar::ptr Kernel1Dvar::_build(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size) {
+    Kernel1Dvar::ptr ret;
     std::string filter = dr.filter();
-    if (boost::iequals(filter.substr(0, min(filter.length(), 7)), "lanczos")) {
+    if (filter.length() == 0)
+      ret = std::make_shared<Lanczos1D>(D_resize::lanczos(3.0), from_start, from_size, from_max, to_size);
+    else if (boost::iequals(filter.substr(0, min(filter.length(), 7)), "lanczos"))
       ret = std::make_shared<Lanczos1D>(dr, from_start, from_size, from_max, to_size);
-      return ret;
+    else if (boost::iequals(filter, "box") || boost::iequals(filter, "area"))
+      ret = std::make_shared<Box1D>(from_start, from_size, from_max, to_size);
+    else if (boost::iequals(filter, "triangle") || boost::iequals(filter, "linear") || boost::iequals(filter, "bilinear"))
+      ret = std::make_shared<Triangle1D>(from_start, from_size, from_max, to_size);
+    else if (boost::iequals(filter, "mitchell") || boost::iequals(filter, "mitchell-netravali"))
+      ret = std::make_shared<Mitchell1D>(from_start, from_size, from_max, to_size);
+    else if (boost::iequals(filter, "catmull-rom") || boost::iequals(filter, "catmullrom"))
+      ret = std::make_shared<CatmullRom1D>(from_start, from_size, from_max, to_size);
+    else if (boost::iequals(filter, "gaussian"))
+      ret = std::make_shared<Gaussian1D>(dr, from_start, from_size, from_max, to_size);
+    else
+      throw DestinationError("resize.filter", filter);
+
+    if (dr.integer().defined() && dr.integer())
+      ret->build_integer();
+    return ret;
+  }
+
+  unsigned int Kernel1Dvar::cache_size = 16;
+  double Kernel1Dvar::cache_quantum = 0;
+  Kernel1Dvar::cache_list Kernel1Dvar::_cache;
+  std::mutex Kernel1Dvar::_cache_lock;
+  std::atomic<unsigned long int> Kernel1Dvar::_cache_hits(0), Kernel1Dvar::_cache_misses(0);
+
+  Kernel1Dvar::ptr Kernel1Dvar::create(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size) {
+    if (cache_quantum > 0) {
+      from_start = round(from_start / cache_quantum) * cache_quantum;
+      from_size = round(from_size / cache_quantum) * cache_quantum;
     }
 
-    throw DestinationError("resize.filter", filter);
+    std::ostringstream oss;
+    oss << std::setprecision(17) << dr << " " << from_start << "+" << from_size << "/" << from_max << " => " << to_size;
+    std::string key = oss.str();
+
+    {
+      std::lock_guard<std::mutex> lock(_cache_lock);
+      for (auto it = _cache.begin(); it != _cache.end(); it++)
+	if (it->first == key) {
+	  _cache.splice(_cache.begin(), _cache, it);
+	  _cache_hits++;
+	  return _cache.front().second;
+	}
+    }
+
+    _cache_misses++;
+    auto ret = _build(dr, from_start, from_size, from_max, to_size);
+
+    std::lock_guard<std::mutex> lock(_cache_lock);
+    // Another thread may have built the same kernel in the meantime
+    for (auto it = _cache.begin(); it != _cache.end(); it++)
+      if (it->first == key) {
+	_cache.splice(_cache.begin(), _cache, it);
+	return _cache.front().second;
+      }
+
+    _cache.emplace_front(key, ret);
+    while (_cache.size() > cache_size)
+      _cache.pop_back();
+
+    return ret;
   }
 
   Kernel1Dvar::~Kernel1Dvar() {
@@ -114,130 +245,210 @@ namespace PhotoFinish {
     }
 
     if (_weights != nullptr) {
-      for (unsigned int i = 0; i < _to_size_i; i++)
-	delete [] _weights[i];
-      delete [] _weights;
+      free(_weights);
       _weights = nullptr;
     }
+
+    if (_int_weights != nullptr) {
+      free(_int_weights);
+      _int_weights = nullptr;
+    }
   }
 
-  // Template method that does the actual horizontal convolving
-  template <typename T, int channels>
-  void Kernel1Dvar::convolve_h_type_channels(Image::ptr src, Image::ptr dest, bool can_free) {
-#pragma omp parallel
-    {
-#pragma omp master
-      {
-	std::cerr << "Convolving image horizontally " << src->width() << " => "
-		  << std::setprecision(2) << std::fixed << dest->width()
-		  << " using " << omp_get_num_threads() << " threads..." << std::endl;
+  // Convolve one row horizontally, every output pixel using 'taps' weights
+  // A non-zero fixed_taps makes the tap count a constant, so that the compiler can unroll the loop
+  template <unsigned int fixed_taps, typename T, int channels, typename O>
+  static void convolve_row_h(const T* inrow, O* out, unsigned int width, const unsigned int* start, const SAMPLE* weights, unsigned int taps) {
+    if (fixed_taps > 0)
+      taps = fixed_taps;
+
+    SAMPLE temp[channels];
+    for (unsigned int nx = 0; nx < width; nx++, weights += taps) {
+      for (unsigned char c = 0; c < channels; c++)
+	temp[c] = 0;
+      const T *in = inrow + (start[nx] * channels);
+      for (unsigned int j = 0; j < taps; j++, in += channels) {
+	for (unsigned char c = 0; c < channels; c++)
+	  temp[c] += in[c] * weights[j];
       }
+      for (unsigned char c = 0; c < channels; c++, out++)
+	*out = limitval<O>(temp[c]);
     }
+  }
 
-    Timer timer;
-    long long pixel_count = 0;
-    timer.start();
+  // The same with fixed-point weights
+  template <unsigned int fixed_taps, typename T, int channels>
+  static void convolve_row_h_integer(const T* inrow, T* out, unsigned int width, const unsigned int* start, const int16_t* weights, unsigned int taps) {
+    if (fixed_taps > 0)
+      taps = fixed_taps;
+    const int32_t round = 1 << (Kernel1Dvar::integer_bits - 1), maxval = scaleval<T>();
+
+    int32_t temp[channels];
+    for (unsigned int nx = 0; nx < width; nx++, weights += taps) {
+      for (unsigned char c = 0; c < channels; c++)
+	temp[c] = round;
+      const T *in = inrow + (start[nx] * channels);
+      for (unsigned int j = 0; j < taps; j++, in += channels) {
+	for (unsigned char c = 0; c < channels; c++)
+	  temp[c] += (int32_t)in[c] * weights[j];
+      }
+      for (unsigned char c = 0; c < channels; c++, out++) {
+	int32_t v = temp[c] >> Kernel1Dvar::integer_bits;
+	*out = v < 0 ? 0 : v > maxval ? maxval : v;
+      }
+    }
+  }
 
-#pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int y = 0; y < src->height(); y++) {
-      dest->check_row_alloc(y);
-      T *out = dest->row(y)->data<T>();
-      SAMPLE temp[channels];
+  template <typename T, int channels, typename O>
+  void Kernel1Dvar::_convolve_row_h(const T* inrow, O* out) const {
+    if constexpr (std::is_same<T, float>::value && std::is_same<O, float>::value && std::is_same<SAMPLE, float>::value) {
+      SIMD::convolve_row_h(inrow, out, _to_size_i, channels, _start, _weights, _taps);
+    } else {
+      // Box, triangle and cubic enlarging pad to 4 taps, Lanczos-3 enlarging and halving to 8 and 16
+      switch (_taps) {
+      case 4:
+	convolve_row_h<4, T, channels, O>(inrow, out, _to_size_i, _start, _weights, _taps);
+	break;
+
+      case 8:
+	convolve_row_h<8, T, channels, O>(inrow, out, _to_size_i, _start, _weights, _taps);
+	break;
+
+      case 16:
+	convolve_row_h<16, T, channels, O>(inrow, out, _to_size_i, _start, _weights, _taps);
+	break;
+
+      default:
+	convolve_row_h<0, T, channels, O>(inrow, out, _to_size_i, _start, _weights, _taps);
+	break;
+      }
+    }
+  }
 
-      for (unsigned int nx = 0; nx < dest->width(); nx++) {
-	for (unsigned char c = 0; c < channels; c++)
-	  temp[c] = 0;
-	const SAMPLE *weight = _weights[nx];
-	const T *in = src->row(y)->data<T>(_start[nx]);
-	for (unsigned int j = _size[nx]; j; j--, weight++) {
-	  for (unsigned char c = 0; c < channels; c++, in++)
-	    temp[c] += (*in) * (*weight);
-	  pixel_count++;
-	}
-	for (unsigned char c = 0; c < channels; c++, out++)
-	  *out = limitval<T>(temp[c]);
+  // Template method that does the actual horizontal convolving
+  template <typename T, int channels>
+  void Kernel1Dvar::convolve_h_type_channels(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free) {
+    if constexpr (std::is_integral<T>::value && (sizeof(T) <= 2))
+      if (_int_weights != nullptr) {
+	convolve_h_integer<T, channels>(src, dest, first, last, can_free);
+	return;
       }
 
+    bool show_progress = !dest->is_lazy();
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int y = first; y < last; y++) {
+      T *out = dest->write_row_data<T>(y);
+      const T *inrow = src->row_data<T>(y);
+      _convolve_row_h<T, channels, T>(inrow, out);
+
       if (can_free)
 	src->free_row(y);
 
-      if (omp_get_thread_num() == 0)
+      if (show_progress && (omp_get_thread_num() == 0))
 	std::cerr << "\r\tConvolved " << y + 1 << " of " << src->height() << " rows";
     }
-    timer.stop();
+  }
 
-    std::cerr << "\r\tConvolved " << src->height() << " of " << src->height() << " rows." << std::endl;
+  // Template method that does horizontal convolving of 8 and 16-bit images with fixed-point weights
+  template <typename T, int channels>
+  void Kernel1Dvar::convolve_h_integer(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free) {
+    bool show_progress = !dest->is_lazy();
 
-    if (benchmark_mode) {
-      std::cerr << std::setprecision(2) << std::fixed;
-      std::cerr << "Benchmark: Horizontally convolved " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second" << std::endl;
-    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int y = first; y < last; y++) {
+      T *out = dest->write_row_data<T>(y);
+      const T *inrow = src->row_data<T>(y);
+
+      switch (_taps) {
+      case 4:
+	convolve_row_h_integer<4, T, channels>(inrow, out, dest->width(), _start, _int_weights, _taps);
+	break;
+
+      case 8:
+	convolve_row_h_integer<8, T, channels>(inrow, out, dest->width(), _start, _int_weights, _taps);
+	break;
+
+      case 16:
+	convolve_row_h_integer<16, T, channels>(inrow, out, dest->width(), _start, _int_weights, _taps);
+	break;
+
+      default:
+	convolve_row_h_integer<0, T, channels>(inrow, out, dest->width(), _start, _int_weights, _taps);
+	break;
+      }
 
+      if (can_free)
+	src->free_row(y);
+
+      if (show_progress && (omp_get_thread_num() == 0))
+	std::cerr << "\r\tConvolved " << y + 1 << " of " << src->height() << " rows";
+    }
   }
 
   // Template method that handles each type for horizontal convolving
   template <typename T>
-  void Kernel1Dvar::convolve_h_type(Image::ptr src, Image::ptr dest, bool can_free) {
+  void Kernel1Dvar::convolve_h_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free) {
     unsigned char channels = src->format().total_channels();
     switch (channels) {
     case 1: // e.g greyscale
-      convolve_h_type_channels<T, 1>(src, dest, can_free);
+      convolve_h_type_channels<T, 1>(src, dest, first, last, can_free);
       break;
 
     case 2: // e.g greyscale with alpha
-      convolve_h_type_channels<T, 2>(src, dest, can_free);
+      convolve_h_type_channels<T, 2>(src, dest, first, last, can_free);
       break;
 
     case 3: // e.g RGB, Lab, etc
-      convolve_h_type_channels<T, 3>(src, dest, can_free);
+      convolve_h_type_channels<T, 3>(src, dest, first, last, can_free);
       break;
 
     case 4: // e.g CMYK, or RGB, Lab, etc with alpha
-      convolve_h_type_channels<T, 4>(src, dest, can_free);
+      convolve_h_type_channels<T, 4>(src, dest, first, last, can_free);
       break;
 
     case 5: // e.g CMYK with alpha
-      convolve_h_type_channels<T, 5>(src, dest, can_free);
+      convolve_h_type_channels<T, 5>(src, dest, first, last, can_free);
       break;
 
     case 6:
-      convolve_h_type_channels<T, 6>(src, dest, can_free);
+      convolve_h_type_channels<T, 6>(src, dest, first, last, can_free);
       break;
 
     case 7:
-      convolve_h_type_channels<T, 7>(src, dest, can_free);
+      convolve_h_type_channels<T, 7>(src, dest, first, last, can_free);
       break;
 
     case 8:
-      convolve_h_type_channels<T, 8>(src, dest, can_free);
+      convolve_h_type_channels<T, 8>(src, dest, first, last, can_free);
       break;
 
     case 9:
-      convolve_h_type_channels<T, 9>(src, dest, can_free);
+      convolve_h_type_channels<T, 9>(src, dest, first, last, can_free);
       break;
 
     case 10:
-      convolve_h_type_channels<T, 10>(src, dest, can_free);
+      convolve_h_type_channels<T, 10>(src, dest, first, last, can_free);
       break;
 
     case 11:
-      convolve_h_type_channels<T, 11>(src, dest, can_free);
+      convolve_h_type_channels<T, 11>(src, dest, first, last, can_free);
       break;
 
     case 12:
-      convolve_h_type_channels<T, 12>(src, dest, can_free);
+      convolve_h_type_channels<T, 12>(src, dest, first, last, can_free);
       break;
 
     case 13:
-      convolve_h_type_channels<T, 13>(src, dest, can_free);
+      convolve_h_type_channels<T, 13>(src, dest, first, last, can_free);
       break;
 
     case 14:
-      convolve_h_type_channels<T, 14>(src, dest, can_free);
+      convolve_h_type_channels<T, 14>(src, dest, first, last, can_free);
       break;
 
     case 15:
-      convolve_h_type_channels<T, 15>(src, dest, can_free);
+      convolve_h_type_channels<T, 15>(src, dest, first, last, can_free);
       break;
 
     default:
@@ -245,8 +456,34 @@ namespace PhotoFinish {
     }
   }
 
-  //! Convolve an image horizontally
-  Image::ptr Kernel1Dvar::convolve_h(Image::ptr img, bool can_free) {
+  void Kernel1Dvar::convolve_h_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, bool can_free) {
+    switch (src->format().bytes_per_channel()) {
+    case 1:
+      convolve_h_type<unsigned char>(src, dest, first, last, can_free);
+      break;
+
+    case 2:
+      if (src->format().is_fp())
+	convolve_h_type<half>(src, dest, first, last, can_free);
+      else
+	convolve_h_type<short unsigned int>(src, dest, first, last, can_free);
+      break;
+
+    case 4:
+      if (src->format().is_fp())
+	convolve_h_type<float>(src, dest, first, last, can_free);
+      else
+	convolve_h_type<unsigned int>(src, dest, first, last, can_free);
+      break;
+
+    case 8:
+      convolve_h_type<double>(src, dest, first, last, can_free);
+      break;
+
+    }
+  }
+
+  Image::ptr Kernel1Dvar::_new_h_image(Image::ptr img) const {
     auto ni = std::make_shared<Image>(_to_size_i, img->height(), img->format());
     ni->set_profile(img->profile());
 
@@ -255,152 +492,704 @@ namespace PhotoFinish {
     if (img->yres().defined())
       ni->set_yres(img->yres());
 
+    return ni;
+  }
+
+  //! Convolve an image horizontally
+  Image::ptr Kernel1Dvar::convolve_h(Image::ptr img, bool can_free) {
+    auto ni = _new_h_image(img);
+    img->generate_all();
+
+#pragma omp parallel
+    {
+#pragma omp master
+      {
+	std::cerr << "Convolving image horizontally " << img->width() << " => "
+		  << std::setprecision(2) << std::fixed << ni->width()
+		  << " using " << omp_get_num_threads() << " threads..." << std::endl;
+      }
+    }
+
+    Timer timer;
+    timer.start();
+    convolve_h_rows(img, ni, 0, img->height(), can_free);
+    timer.stop();
+
+    std::cerr << "\r\tConvolved " << img->height() << " of " << img->height() << " rows." << std::endl;
+
+    if (benchmark_mode) {
+      long long pixel_count = 0;
+      for (unsigned int nx = 0; nx < _to_size_i; nx++)
+	pixel_count += _size[nx];
+      pixel_count *= img->height();
+      std::cerr << std::setprecision(2) << std::fixed;
+      std::cerr << "Benchmark: Horizontally convolved " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second (" << name() << ", " << SIMD::level() << ")" << std::endl;
+    }
+
+    return ni;
+  }
+
+  //! Produces the rows of a horizontally convolved image as they are needed
+  class ConvolveHGenerator : public RowGenerator {
+  private:
+    Kernel1Dvar::ptr _kernel;
+    Image::ptr _src;
+    bool _can_free;
+
+  public:
+    ConvolveHGenerator(Kernel1Dvar::ptr kernel, Image::ptr src, bool can_free) :
+      _kernel(kernel), _src(src),
+      _can_free(can_free)
+    {}
+
+    void generate(Image& dest, unsigned int first, unsigned int last) {
+      _src->check_row_generated(last - 1);
+      _kernel->convolve_h_rows(_src, dest.shared_from_this(), first, last, _can_free);
+    }
+
+  }; // class ConvolveHGenerator
+
+  Image::ptr Kernel1Dvar::convolve_h_lazy(Image::ptr img, bool can_free) {
+    auto ni = _new_h_image(img);
+    std::cerr << "Convolving image horizontally " << img->width() << " => "
+	      << std::setprecision(2) << std::fixed << ni->width()
+	      << " as rows are needed." << std::endl;
+    ni->set_generator(std::make_shared<ConvolveHGenerator>(shared_from_this(), img, can_free));
+    return ni;
+  }
+
+  // Template method that does the actual vertical convolving
+  template <typename T, int channels>
+  void Kernel1Dvar::convolve_v_type_channels(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    if constexpr (std::is_integral<T>::value && (sizeof(T) <= 2))
+      if (_int_weights != nullptr) {
+	convolve_v_integer<T, channels>(src, dest, first, last, releaser);
+	return;
+      }
+
+    bool show_progress = !dest->is_lazy();
+    ImageView src_view(src, _start[first], _start[last - 1] + _size[last - 1]);
+    for (unsigned int ny = first; ny < last; ny++)
+      dest->check_row_alloc(ny);
+
+    // Rows are split into strips so that narrow ranges of rows still use every thread
+    const size_t row_values = src->width() * channels;
+    const unsigned int num_strips = (row_values + v_strip_values - 1) / v_strip_values;
+    std::vector<std::atomic<unsigned int>> strips_left(last - first);
+    for (auto& left : strips_left)
+      left = num_strips;
+
+#pragma omp parallel
+    {
+      // Each thread reuses its list of input rows and its strip of sums
+      std::vector<const T*> inrows;
+      std::vector<SAMPLE> sums(v_strip_values);
+
+#pragma omp for collapse(2) schedule(dynamic, 1)
+      for (unsigned int ny = first; ny < last; ny++) {
+	for (unsigned int strip = 0; strip < num_strips; strip++) {
+	  unsigned int max = _size[ny];
+	  unsigned int ystart = _start[ny];
+	  size_t offset = strip * v_strip_values;
+	  size_t n = std::min<size_t>(v_strip_values, row_values - offset);
+
+	  T *out = dest->write_row_data<T>(ny) + offset;
+	  inrows.resize(max);
+	  for (unsigned int j = 0; j < max; j++)
+	    inrows[j] = src_view.data<T>(ystart + j) + offset;
+
+	  const SAMPLE *weight = _weights + ((size_t)ny * _taps);
+	  if constexpr (std::is_same<T, float>::value && std::is_same<SAMPLE, float>::value) {
+	    SIMD::weighted_sum_rows(inrows.data(), weight, max, out, n);
+	  } else {
+	    {
+	      const T *in = inrows[0];
+	      SAMPLE w = weight[0];
+	      for (size_t i = 0; i < n; i++)
+		sums[i] = in[i] * w;
+	    }
+	    for (unsigned int j = 1; j < max; j++) {
+	      const T *in = inrows[j];
+	      SAMPLE w = weight[j];
+	      for (size_t i = 0; i < n; i++)
+		sums[i] += in[i] * w;
+	    }
+
+	    for (size_t i = 0; i < n; i++)
+	      out[i] = limitval<T>(sums[i]);
+	  }
+
+	  // Whichever thread finishes the last strip of a row finishes the row
+	  if (--strips_left[ny - first] == 0) {
+	    if (releaser != nullptr)
+	      releaser->finish(ny, [this](unsigned int y) { return _start[y]; });
+
+	    if (show_progress && (omp_get_thread_num() == 0))
+	      std::cerr << "\r\tConvolved " << ny + 1 << " of " << _to_size_i << " rows";
+	  }
+	}
+      }
+    }
+  }
+
+  // Template method that does vertical convolving of 8 and 16-bit images with fixed-point weights
+  template <typename T, int channels>
+  void Kernel1Dvar::convolve_v_integer(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    bool show_progress = !dest->is_lazy();
+    ImageView src_view(src, _start[first], _start[last - 1] + _size[last - 1]);
+    const int32_t round = 1 << (integer_bits - 1), maxval = scaleval<T>();
+    for (unsigned int ny = first; ny < last; ny++)
+      dest->check_row_alloc(ny);
+
+    const size_t row_values = src->width() * channels;
+    const unsigned int num_strips = (row_values + v_strip_values - 1) / v_strip_values;
+    std::vector<std::atomic<unsigned int>> strips_left(last - first);
+    for (auto& left : strips_left)
+      left = num_strips;
+
+#pragma omp parallel
+    {
+      std::vector<const T*> inrows;
+      std::vector<int32_t> sums(v_strip_values);
+
+#pragma omp for collapse(2) schedule(dynamic, 1)
+      for (unsigned int ny = first; ny < last; ny++) {
+	for (unsigned int strip = 0; strip < num_strips; strip++) {
+	  unsigned int max = _size[ny];
+	  unsigned int ystart = _start[ny];
+	  size_t offset = strip * v_strip_values;
+	  size_t n = std::min<size_t>(v_strip_values, row_values - offset);
+
+	  T *out = dest->write_row_data<T>(ny) + offset;
+	  inrows.resize(max);
+	  for (unsigned int j = 0; j < max; j++)
+	    inrows[j] = src_view.data<T>(ystart + j) + offset;
+
+	  for (size_t i = 0; i < n; i++)
+	    sums[i] = round;
+
+	  const int16_t *weight = _int_weights + ((size_t)ny * _taps);
+	  for (unsigned int j = 0; j < max; j++) {
+	    const T *in = inrows[j];
+	    int32_t w = weight[j];
+	    for (size_t i = 0; i < n; i++)
+	      sums[i] += (int32_t)in[i] * w;
+	  }
+
+	  for (size_t i = 0; i < n; i++) {
+	    int32_t v = sums[i] >> integer_bits;
+	    out[i] = v < 0 ? 0 : v > maxval ? maxval : v;
+	  }
+
+	  if (--strips_left[ny - first] == 0) {
+	    if (releaser != nullptr)
+	      releaser->finish(ny, [this](unsigned int y) { return _start[y]; });
+
+	    if (show_progress && (omp_get_thread_num() == 0))
+	      std::cerr << "\r\tConvolved " << ny + 1 << " of " << _to_size_i << " rows";
+	  }
+	}
+      }
+    }
+  }
+
+  // Template method that does the actual convolving with several kernels
+  template <typename T, int channels>
+  void Kernel1Dvar::_convolve_h_many_type_channels(const std::vector<ptr>& kernels, const std::vector<unsigned int>& first, const std::vector<unsigned int>& last,
+						   Image::ptr src, const std::vector<Image::ptr>& dests, bool can_free) {
+    for (unsigned int i = 0; i < kernels.size(); i++)
+      for (unsigned int y = first[i]; y < last[i]; y++)
+	dests[i]->check_row_alloc(y);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int y = 0; y < src->height(); y++) {
+      const T *inrow = src->row_data<T>(y);
+      for (unsigned int i = 0; i < kernels.size(); i++)
+	if ((y >= first[i]) && (y < last[i]))
+	  kernels[i]->_convolve_row_h<T, channels, T>(inrow, dests[i]->write_row_data<T>(y));
+
+      if (can_free)
+	src->free_row(y);
+
+      if (omp_get_thread_num() == 0)
+	std::cerr << "\r\tConvolved " << y + 1 << " of " << src->height() << " rows";
+    }
+  }
+
+  // Template method that handles each type for convolving with several kernels
+  template <typename T>
+  void Kernel1Dvar::_convolve_h_many_type(const std::vector<ptr>& kernels, const std::vector<unsigned int>& first, const std::vector<unsigned int>& last,
+					  Image::ptr src, const std::vector<Image::ptr>& dests, bool can_free) {
+    unsigned char channels = src->format().total_channels();
+    switch (channels) {
+    case 1:
+      _convolve_h_many_type_channels<T, 1>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 2:
+      _convolve_h_many_type_channels<T, 2>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 3:
+      _convolve_h_many_type_channels<T, 3>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 4:
+      _convolve_h_many_type_channels<T, 4>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 5:
+      _convolve_h_many_type_channels<T, 5>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 6:
+      _convolve_h_many_type_channels<T, 6>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 7:
+      _convolve_h_many_type_channels<T, 7>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 8:
+      _convolve_h_many_type_channels<T, 8>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 9:
+      _convolve_h_many_type_channels<T, 9>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 10:
+      _convolve_h_many_type_channels<T, 10>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 11:
+      _convolve_h_many_type_channels<T, 11>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 12:
+      _convolve_h_many_type_channels<T, 12>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 13:
+      _convolve_h_many_type_channels<T, 13>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 14:
+      _convolve_h_many_type_channels<T, 14>(kernels, first, last, src, dests, can_free);
+      break;
+
+    case 15:
+      _convolve_h_many_type_channels<T, 15>(kernels, first, last, src, dests, can_free);
+      break;
+    }
+  }
+
+  std::vector<Image::ptr> Kernel1Dvar::convolve_h_many(Image::ptr img, const std::vector<ptr>& kernels,
+						       const std::vector<unsigned int>& first, const std::vector<unsigned int>& last,
+						       bool can_free) {
+    std::vector<Image::ptr> nis;
+    for (auto kernel : kernels)
+      nis.push_back(kernel->_new_h_image(img));
+    img->generate_all();
+
+#pragma omp parallel
+    {
+#pragma omp master
+      {
+	std::cerr << "Convolving image horizontally " << img->width() << " =>";
+	for (auto ni : nis)
+	  std::cerr << " " << ni->width();
+	std::cerr << " using " << omp_get_num_threads() << " threads..." << std::endl;
+      }
+    }
+
+    Timer timer;
+    timer.start();
     switch (img->format().bytes_per_channel()) {
     case 1:
-      convolve_h_type<unsigned char>(img, ni, can_free);
+      _convolve_h_many_type<unsigned char>(kernels, first, last, img, nis, can_free);
       break;
 
     case 2:
-      convolve_h_type<short unsigned int>(img, ni, can_free);
+      if (img->format().is_fp())
+	_convolve_h_many_type<half>(kernels, first, last, img, nis, can_free);
+      else
+	_convolve_h_many_type<short unsigned int>(kernels, first, last, img, nis, can_free);
       break;
 
     case 4:
       if (img->format().is_fp())
-	convolve_h_type<float>(img, ni, can_free);
+	_convolve_h_many_type<float>(kernels, first, last, img, nis, can_free);
       else
-	convolve_h_type<unsigned int>(img, ni, can_free);
+	_convolve_h_many_type<unsigned int>(kernels, first, last, img, nis, can_free);
       break;
 
     case 8:
-      convolve_h_type<double>(img, ni, can_free);
+      _convolve_h_many_type<double>(kernels, first, last, img, nis, can_free);
       break;
 
     }
+    timer.stop();
 
-    return ni;
+    std::cerr << "\r\tConvolved " << img->height() << " of " << img->height() << " rows." << std::endl;
+
+    if (benchmark_mode) {
+      long long pixel_count = 0;
+      for (unsigned int i = 0; i < kernels.size(); i++) {
+	long long row_count = 0;
+	for (unsigned int nx = 0; nx < kernels[i]->_to_size_i; nx++)
+	  row_count += kernels[i]->_size[nx];
+	pixel_count += row_count * (last[i] - first[i]);
+      }
+      std::cerr << std::setprecision(2) << std::fixed;
+      std::cerr << "Benchmark: Horizontally convolved " << pixel_count << " pixels for " << kernels.size() << " sizes in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second (" << SIMD::level() << ")" << std::endl;
+    }
+
+    return nis;
   }
 
-  // Template method that does the actual vertical convolving
+  // Weighted sum of whole rows into a row of SAMPLEs
+  template <typename T>
+  static void sum_rows(const T* const* rows, const SAMPLE* weights, unsigned int taps, SAMPLE* out, size_t n) {
+    if constexpr (std::is_same<T, float>::value && std::is_same<SAMPLE, float>::value) {
+      SIMD::weighted_sum_rows(rows, weights, taps, out, n);
+    } else {
+      {
+	const T *in = rows[0];
+	SAMPLE w = weights[0];
+	for (size_t i = 0; i < n; i++)
+	  out[i] = in[i] * w;
+      }
+      for (unsigned int j = 1; j < taps; j++) {
+	const T *in = rows[j];
+	SAMPLE w = weights[j];
+	for (size_t i = 0; i < n; i++)
+	  out[i] += in[i] * w;
+      }
+    }
+  }
+
+  // Template method that does the actual resizing in both directions
   template <typename T, int channels>
-  void Kernel1Dvar::convolve_v_type_channels(Image::ptr src, Image::ptr dest, bool can_free) {
+  void Kernel1Dvar::_convolve_hv_type_channels(const Kernel1Dvar& h_kernel, const Kernel1Dvar& v_kernel, Image::ptr src, Image::ptr dest, bool h_first,
+						unsigned int first_row, unsigned int last_row, RowReleaser* releaser) {
+    ImageView src_view(src);
+    const unsigned int out_height = v_kernel._to_size_i;
+    for (unsigned int ny = first_row; ny < last_row; ny++)
+      dest->check_row_alloc(ny);
+
+    if (h_first) {
+      // Bands are made small enough for every thread to have several, the rows
+      // of the ring at the start of each band are convolved again
+      const size_t row_values = (size_t)h_kernel._to_size_i * channels;
+      const unsigned int ring_rows = v_kernel._taps;
+      unsigned int band_rows = ceil((last_row - first_row) / (4.0 * omp_get_max_threads()));
+      if (band_rows < v_kernel._min_band_rows())
+	band_rows = v_kernel._min_band_rows();
+      const unsigned int num_bands = (last_row - first_row + band_rows - 1) / band_rows;
+
+#pragma omp parallel
+      {
+	std::vector<SAMPLE> ring(ring_rows * row_values), sums;
+	std::vector<const SAMPLE*> inrows(ring_rows);
+	if (!std::is_same<T, SAMPLE>::value)
+	  sums.resize(row_values);
+
+#pragma omp for schedule(dynamic, 1)
+	for (unsigned int band = 0; band < num_bands; band++) {
+	  unsigned int first = first_row + (band * band_rows), last = min(first + band_rows, last_row);
+	  unsigned int next = v_kernel._start[first];	// The next source row to go into the ring
+
+	  for (unsigned int ny = first; ny < last; ny++) {
+	    unsigned int ystart = v_kernel._start[ny], max = v_kernel._size[ny];
+	    if (next < ystart)
+	      next = ystart;
+	    for (; next < ystart + max; next++)
+	      h_kernel._convolve_row_h<T, channels, SAMPLE>(src_view.data<T>(next), ring.data() + ((next % ring_rows) * row_values));
+
+	    for (unsigned int j = 0; j < max; j++)
+	      inrows[j] = ring.data() + (((ystart + j) % ring_rows) * row_values);
+
+	    T *out = dest->write_row_data<T>(ny);
+	    if constexpr (std::is_same<T, SAMPLE>::value) {
+	      sum_rows<SAMPLE>(inrows.data(), v_kernel.weights(ny), max, out, row_values);
+	    } else {
+	      sum_rows<SAMPLE>(inrows.data(), v_kernel.weights(ny), max, sums.data(), row_values);
+	      for (size_t i = 0; i < row_values; i++)
+		out[i] = limitval<T>(sums[i]);
+	    }
+
+	    if (releaser != nullptr)
+	      releaser->finish(ny, [&v_kernel](unsigned int y) { return v_kernel._start[y]; });
+
+	    if (omp_get_thread_num() == 0)
+	      std::cerr << "\r\tResized " << ny + 1 << " of " << out_height << " rows";
+	  }
+	}
+      }
+      return;
+    }
+
+#pragma omp parallel
+    {
+      std::vector<SAMPLE> temp((size_t)src->width() * channels);
+      std::vector<const T*> inrows(v_kernel._taps);
+
+#pragma omp for schedule(dynamic, 1)
+      for (unsigned int ny = first_row; ny < last_row; ny++) {
+	unsigned int ystart = v_kernel._start[ny], max = v_kernel._size[ny];
+	for (unsigned int j = 0; j < max; j++)
+	  inrows[j] = src_view.data<T>(ystart + j);
+
+	sum_rows<T>(inrows.data(), v_kernel.weights(ny), max, temp.data(), temp.size());
+	h_kernel._convolve_row_h<SAMPLE, channels, T>(temp.data(), dest->write_row_data<T>(ny));
+
+	if (releaser != nullptr)
+	  releaser->finish(ny, [&v_kernel](unsigned int y) { return v_kernel._start[y]; });
+
+	if (omp_get_thread_num() == 0)
+	  std::cerr << "\r\tResized " << ny + 1 << " of " << out_height << " rows";
+      }
+    }
+  }
+
+  // Template method that handles each type for resizing in both directions
+  template <typename T>
+  void Kernel1Dvar::_convolve_hv_type(const Kernel1Dvar& h_kernel, const Kernel1Dvar& v_kernel, Image::ptr src, Image::ptr dest, bool h_first,
+				       unsigned int first, unsigned int last, RowReleaser* releaser) {
+    unsigned char channels = src->format().total_channels();
+    switch (channels) {
+    case 1:
+      _convolve_hv_type_channels<T, 1>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 2:
+      _convolve_hv_type_channels<T, 2>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 3:
+      _convolve_hv_type_channels<T, 3>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 4:
+      _convolve_hv_type_channels<T, 4>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 5:
+      _convolve_hv_type_channels<T, 5>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 6:
+      _convolve_hv_type_channels<T, 6>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 7:
+      _convolve_hv_type_channels<T, 7>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 8:
+      _convolve_hv_type_channels<T, 8>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 9:
+      _convolve_hv_type_channels<T, 9>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 10:
+      _convolve_hv_type_channels<T, 10>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 11:
+      _convolve_hv_type_channels<T, 11>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 12:
+      _convolve_hv_type_channels<T, 12>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 13:
+      _convolve_hv_type_channels<T, 13>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 14:
+      _convolve_hv_type_channels<T, 14>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+
+    case 15:
+      _convolve_hv_type_channels<T, 15>(h_kernel, v_kernel, src, dest, h_first, first, last, releaser);
+      break;
+    }
+  }
+
+  unsigned int Kernel1Dvar::_min_band_rows(void) const {
+    // A band of n output rows reads about n * _scale input rows and convolves
+    // up to _taps of them again, keep that to an eighth or less
+    unsigned int rows = ceil(8 * _taps / _scale);
+    return rows < 16 ? 16 : rows;
+  }
+
+  Image::ptr Kernel1Dvar::convolve_hv(ptr h_kernel, ptr v_kernel, Image::ptr img, bool can_free, rows_done_func rows_done) {
+    // Count the multiply-adds of each order
+    double h_taps = 0, v_taps = 0;
+    for (unsigned int nx = 0; nx < h_kernel->_to_size_i; nx++)
+      h_taps += h_kernel->_size[nx];
+    for (unsigned int ny = 0; ny < v_kernel->_to_size_i; ny++)
+      v_taps += v_kernel->_size[ny];
+    double h_first_count = (h_taps * img->height()) + (v_taps * h_kernel->_to_size_i);
+    double v_first_count = (v_taps * img->width()) + (h_taps * v_kernel->_to_size_i);
+    bool h_first = h_first_count < v_first_count;
+
+    if ((h_kernel->_int_weights != nullptr) || (v_kernel->_int_weights != nullptr)) {
+      Image::ptr ni;
+      if (h_first) {
+	auto temp = h_kernel->convolve_h(img, can_free);
+	ni = v_kernel->convolve_v(temp, true);
+      } else {
+	auto temp = v_kernel->convolve_v(img, can_free);
+	ni = h_kernel->convolve_h(temp, true);
+      }
+      if (rows_done)
+	rows_done(ni, ni->height());
+      return ni;
+    }
+
+    auto ni = std::make_shared<Image>(h_kernel->_to_size_i, v_kernel->_to_size_i, img->format());
+    ni->set_profile(img->profile());
+    if (img->xres().defined())
+      ni->set_xres(img->xres() / h_kernel->_scale);
+    if (img->yres().defined())
+      ni->set_yres(img->yres() / v_kernel->_scale);
+
+    img->generate_all();
+
 #pragma omp parallel
     {
 #pragma omp master
       {
-	std::cerr << "Convolving image vertically " << src->height() << " => "
-		  << std::setprecision(2) << std::fixed << dest->height()
+	std::cerr << "Resizing image " << img->width() << "x" << img->height() << " => "
+		  << ni->width() << "x" << ni->height()
+		  << (h_first ? ", horizontally first," : ", vertically first,")
 		  << " using " << omp_get_num_threads() << " threads..." << std::endl;
       }
     }
 
-    Timer timer;
-    long long pixel_count = 0;
-    timer.start();
+    std::shared_ptr<RowReleaser> releaser;
+    if (can_free)
+      releaser = std::make_shared<RowReleaser>(img, ni->height());
 
-#pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int ny = 0; ny < dest->height(); ny++) {
-      unsigned int max = _size[ny];
-      unsigned int ystart = _start[ny];
+    // Enough rows for every thread to have a few bands of its own
+    unsigned int chunk_rows = ni->height();
+    if (rows_done)
+      chunk_rows = 4 * v_kernel->_min_band_rows() * omp_get_max_threads();
 
-      dest->check_row_alloc(ny);
-      T *out = dest->row(ny)->data<T>();
-      SAMPLE temp[channels];
-      for (unsigned int x = 0; x < src->width(); x++) {
-	for (unsigned char c = 0; c < channels; c++)
-	  temp[c] = 0;
-
-	const SAMPLE *weight = _weights[ny];
-	for (unsigned int j = 0; j < max; j++, weight++) {
-	  T *in = src->row(ystart + j)->data<T>(x);
-	  for (unsigned char c = 0; c < channels; c++, in++)
-	    temp[c] += (*in) * (*weight);
-	  pixel_count++;
-	}
+    Timer timer;
+    timer.start();
+    for (unsigned int first = 0; first < ni->height(); first += chunk_rows) {
+      unsigned int last = min(first + chunk_rows, ni->height());
+      switch (img->format().bytes_per_channel()) {
+      case 1:
+	_convolve_hv_type<unsigned char>(*h_kernel, *v_kernel, img, ni, h_first, first, last, releaser.get());
+	break;
+
+      case 2:
+	if (img->format().is_fp())
+	  _convolve_hv_type<half>(*h_kernel, *v_kernel, img, ni, h_first, first, last, releaser.get());
+	else
+	  _convolve_hv_type<short unsigned int>(*h_kernel, *v_kernel, img, ni, h_first, first, last, releaser.get());
+	break;
+
+      case 4:
+	if (img->format().is_fp())
+	  _convolve_hv_type<float>(*h_kernel, *v_kernel, img, ni, h_first, first, last, releaser.get());
+	else
+	  _convolve_hv_type<unsigned int>(*h_kernel, *v_kernel, img, ni, h_first, first, last, releaser.get());
+	break;
+
+      case 8:
+	_convolve_hv_type<double>(*h_kernel, *v_kernel, img, ni, h_first, first, last, releaser.get());
+	break;
 
-	for (unsigned char c = 0; c < channels; c++, out++)
-	  *out = limitval<T>(temp[c]);
       }
 
-      if (can_free)
-	src->free_row(ny);
-
-      if (omp_get_thread_num() == 0)
-	std::cerr << "\r\tConvolved " << ny + 1 << " of " << _to_size_i << " rows";
+      if (rows_done)
+	rows_done(ni, last);
     }
     timer.stop();
 
-    std::cerr << "\r\tConvolved " << _to_size_i << " of " << _to_size_i << " rows." << std::endl;
+    std::cerr << "\r\tResized " << ni->height() << " of " << ni->height() << " rows." << std::endl;
 
     if (benchmark_mode) {
+      long long pixel_count = h_first ? h_first_count : v_first_count;
       std::cerr << std::setprecision(2) << std::fixed;
-      std::cerr << "Benchmark: Vertically convolved " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second" << std::endl;
+      std::cerr << "Benchmark: Resized " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second (" << h_kernel->name() << ", " << SIMD::level() << ")" << std::endl;
     }
 
+    return ni;
   }
 
   // Template method that handles each type for vertical convolving
   template <typename T>
-  void Kernel1Dvar::convolve_v_type(Image::ptr src, Image::ptr dest, bool can_free) {
+  void Kernel1Dvar::convolve_v_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
     unsigned char channels = src->format().total_channels();
     switch (channels) {
     case 1:
-      convolve_v_type_channels<T, 1>(src, dest, can_free);
+      convolve_v_type_channels<T, 1>(src, dest, first, last, releaser);
       break;
 
     case 2:
-      convolve_v_type_channels<T, 2>(src, dest, can_free);
+      convolve_v_type_channels<T, 2>(src, dest, first, last, releaser);
       break;
 
     case 3:
-      convolve_v_type_channels<T, 3>(src, dest, can_free);
+      convolve_v_type_channels<T, 3>(src, dest, first, last, releaser);
       break;
 
     case 4:
-      convolve_v_type_channels<T, 4>(src, dest, can_free);
+      convolve_v_type_channels<T, 4>(src, dest, first, last, releaser);
       break;
 
     case 5:
-      convolve_v_type_channels<T, 5>(src, dest, can_free);
+      convolve_v_type_channels<T, 5>(src, dest, first, last, releaser);
       break;
 
     case 6:
-      convolve_v_type_channels<T, 6>(src, dest, can_free);
+      convolve_v_type_channels<T, 6>(src, dest, first, last, releaser);
       break;
 
     case 7:
-      convolve_v_type_channels<T, 7>(src, dest, can_free);
+      convolve_v_type_channels<T, 7>(src, dest, first, last, releaser);
       break;
 
     case 8:
-      convolve_v_type_channels<T, 8>(src, dest, can_free);
+      convolve_v_type_channels<T, 8>(src, dest, first, last, releaser);
       break;
 
     case 9:
-      convolve_v_type_channels<T, 9>(src, dest, can_free);
+      convolve_v_type_channels<T, 9>(src, dest, first, last, releaser);
       break;
 
     case 10:
-      convolve_v_type_channels<T, 10>(src, dest, can_free);
+      convolve_v_type_channels<T, 10>(src, dest, first, last, releaser);
       break;
 
     case 11:
-      convolve_v_type_channels<T, 11>(src, dest, can_free);
+      convolve_v_type_channels<T, 11>(src, dest, first, last, releaser);
       break;
 
     case 12:
-      convolve_v_type_channels<T, 12>(src, dest, can_free);
+      convolve_v_type_channels<T, 12>(src, dest, first, last, releaser);
       break;
 
     case 13:
-      convolve_v_type_channels<T, 13>(src, dest, can_free);
+      convolve_v_type_channels<T, 13>(src, dest, first, last, releaser);
       break;
 
     case 14:
-      convolve_v_type_channels<T, 14>(src, dest, can_free);
+      convolve_v_type_channels<T, 14>(src, dest, first, last, releaser);
       break;
 
     case 15:
-      convolve_v_type_channels<T, 15>(src, dest, can_free);
+      convolve_v_type_channels<T, 15>(src, dest, first, last, releaser);
       break;
 
     default:
@@ -408,41 +1197,125 @@ namespace PhotoFinish {
     }
   }
 
-  //! Convolve an image vertically
-  Image::ptr Kernel1Dvar::convolve_v(Image::ptr img, bool can_free) {
-    auto ni = std::make_shared<Image>(img->width(), _to_size_i, img->format());
-    ni->set_profile(img->profile());
-
-    if (img->xres().defined())
-      ni->set_xres(img->xres());
-    if (img->yres().defined())
-      ni->set_yres(img->yres() / _scale);
-
-    switch (img->format().bytes_per_channel()) {
+  void Kernel1Dvar::convolve_v_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    switch (src->format().bytes_per_channel()) {
     case 1:
-      convolve_v_type<unsigned char>(img, ni, can_free);
+      convolve_v_type<unsigned char>(src, dest, first, last, releaser);
       break;
 
     case 2:
-      convolve_v_type<short unsigned int>(img, ni, can_free);
+      if (src->format().is_fp())
+	convolve_v_type<half>(src, dest, first, last, releaser);
+      else
+	convolve_v_type<short unsigned int>(src, dest, first, last, releaser);
       break;
 
     case 4:
-      if (img->format().is_fp())
-	convolve_v_type<float>(img, ni, can_free);
+      if (src->format().is_fp())
+	convolve_v_type<float>(src, dest, first, last, releaser);
       else
-	convolve_v_type<unsigned int>(img, ni, can_free);
+	convolve_v_type<unsigned int>(src, dest, first, last, releaser);
       break;
 
     case 8:
-      convolve_v_type<double>(img, ni, can_free);
+      convolve_v_type<double>(src, dest, first, last, releaser);
       break;
 
     }
+  }
+
+  Image::ptr Kernel1Dvar::_new_v_image(Image::ptr img) const {
+    auto ni = std::make_shared<Image>(img->width(), _to_size_i, img->format());
+    ni->set_profile(img->profile());
+
+    if (img->xres().defined())
+      ni->set_xres(img->xres());
+    if (img->yres().defined())
+      ni->set_yres(img->yres() / _scale);
 
     return ni;
   }
 
+  //! Convolve an image vertically
+  Image::ptr Kernel1Dvar::convolve_v(Image::ptr img, bool can_free) {
+    auto ni = _new_v_image(img);
+    img->generate_all();
+
+#pragma omp parallel
+    {
+#pragma omp master
+      {
+	std::cerr << "Convolving image vertically " << img->height() << " => "
+		  << std::setprecision(2) << std::fixed << ni->height()
+		  << " using " << omp_get_num_threads() << " threads..." << std::endl;
+      }
+    }
+
+    Timer timer;
+    timer.start();
+    if (can_free) {
+      RowReleaser releaser(img, _to_size_i);
+      convolve_v_rows(img, ni, 0, _to_size_i, &releaser);
+    } else
+      convolve_v_rows(img, ni, 0, _to_size_i, nullptr);
+    timer.stop();
+
+    std::cerr << "\r\tConvolved " << _to_size_i << " of " << _to_size_i << " rows." << std::endl;
+
+    if (benchmark_mode) {
+      long long pixel_count = 0;
+      for (unsigned int ny = 0; ny < _to_size_i; ny++)
+	pixel_count += _size[ny];
+      pixel_count *= img->width();
+      std::cerr << std::setprecision(2) << std::fixed;
+      std::cerr << "Benchmark: Vertically convolved " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second (" << name() << ", " << SIMD::level() << ")" << std::endl;
+    }
+
+    return ni;
+  }
+
+  //! Produces the rows of a vertically convolved image as they are needed
+  /*!
+    Only the source rows under the taps of the rows being produced are kept;
+    everything above them is freed as soon as it is no longer needed.
+   */
+  class ConvolveVGenerator : public RowGenerator {
+  private:
+    Kernel1Dvar::ptr _kernel;
+    Image::ptr _src;
+    bool _can_free;
+    unsigned int _freed;
+
+  public:
+    ConvolveVGenerator(Kernel1Dvar::ptr kernel, Image::ptr src, bool can_free) :
+      _kernel(kernel), _src(src),
+      _can_free(can_free),
+      _freed(0)
+    {}
+
+    void generate(Image& dest, unsigned int first, unsigned int last) {
+      _src->check_row_generated(_kernel->start(last - 1) + _kernel->size(last - 1) - 1);
+      _kernel->convolve_v_rows(_src, dest.shared_from_this(), first, last, nullptr);
+
+      if (!_can_free)
+	return;
+
+      unsigned int needed = last < dest.height() ? _kernel->start(last) : _src->height();
+      for (; _freed < needed; _freed++)
+	_src->free_row(_freed);
+    }
+
+  }; // class ConvolveVGenerator
+
+  Image::ptr Kernel1Dvar::convolve_v_lazy(Image::ptr img, bool can_free) {
+    auto ni = _new_v_image(img);
+    std::cerr << "Convolving image vertically " << img->height() << " => "
+	      << std::setprecision(2) << std::fixed << ni->height()
+	      << " as rows are needed." << std::endl;
+    ni->set_generator(std::make_shared<ConvolveVGenerator>(shared_from_this(), img, can_free));
+    return ni;
+  }
+
 
 
   Lanczos1D::Lanczos1D() :
@@ -461,6 +1334,10 @@ namespace PhotoFinish {
     return _radius;
   }
 
+  double Lanczos1D::input_scale(double range) const {
+    return this->range() / ceil(range);
+  }
+
   SAMPLE Lanczos1D::eval(double x) const {
     if (!_radius.defined())
       throw Uninitialised("Lanczos1D", "resize.radius");
@@ -471,4 +1348,115 @@ namespace PhotoFinish {
     return (_radius * sin(pix) * sin(pix * _r_radius)) / (sqr(M_PI) * sqr(x));
   }
 
+  std::string Lanczos1D::name(void) const {
+    return "Lanczos-" + std::to_string((int)_radius);
+  }
+
+
+
+  Box1D::Box1D(double from_start, double from_size, unsigned int from_max, double to_size) :
+    Kernel1Dvar(to_size)
+  {
+    build(from_start, from_size, from_max);
+  }
+
+  double Box1D::range(void) const {
+    return 0.5;
+  }
+
+  SAMPLE Box1D::eval(double x) const {
+    return (x >= -0.5) && (x < 0.5) ? 1.0 : 0.0;
+  }
+
+  std::string Box1D::name(void) const {
+    return "box";
+  }
+
+
+
+  Triangle1D::Triangle1D(double from_start, double from_size, unsigned int from_max, double to_size) :
+    Kernel1Dvar(to_size)
+  {
+    build(from_start, from_size, from_max);
+  }
+
+  double Triangle1D::range(void) const {
+    return 1.0;
+  }
+
+  SAMPLE Triangle1D::eval(double x) const {
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+  }
+
+  std::string Triangle1D::name(void) const {
+    return "triangle";
+  }
+
+
+
+  Cubic1D::Cubic1D(double b, double c, double from_start, double from_size, unsigned int from_max, double to_size) :
+    Kernel1Dvar(to_size),
+    _p0((6 - (2 * b)) / 6),
+    _p2((-18 + (12 * b) + (6 * c)) / 6),
+    _p3((12 - (9 * b) - (6 * c)) / 6),
+    _q0(((8 * b) + (24 * c)) / 6),
+    _q1((-(12 * b) - (48 * c)) / 6),
+    _q2(((6 * b) + (30 * c)) / 6),
+    _q3((-b - (6 * c)) / 6)
+  {
+    build(from_start, from_size, from_max);
+  }
+
+  double Cubic1D::range(void) const {
+    return 2.0;
+  }
+
+  SAMPLE Cubic1D::eval(double x) const {
+    x = fabs(x);
+    if (x < 1.0)
+      return _p0 + (x * x * (_p2 + (x * _p3)));
+    if (x < 2.0)
+      return _q0 + (x * (_q1 + (x * (_q2 + (x * _q3)))));
+    return 0.0;
+  }
+
+  Mitchell1D::Mitchell1D(double from_start, double from_size, unsigned int from_max, double to_size) :
+    Cubic1D(1.0 / 3, 1.0 / 3, from_start, from_size, from_max, to_size)
+  {}
+
+  std::string Mitchell1D::name(void) const {
+    return "Mitchell";
+  }
+
+  CatmullRom1D::CatmullRom1D(double from_start, double from_size, unsigned int from_max, double to_size) :
+    Cubic1D(0.0, 0.5, from_start, from_size, from_max, to_size)
+  {}
+
+  std::string CatmullRom1D::name(void) const {
+    return "Catmull-Rom";
+  }
+
+
+
+  Gaussian1D::Gaussian1D(const D_resize& dr, double from_start, double from_size, unsigned int from_max, double to_size) :
+    Kernel1Dvar(to_size),
+    _radius(dr.support().defined() ? (double)dr.support() : 1.5),
+    _r_2sigma2(1.0 / (2 * sqr(_radius / 3)))
+  {
+    build(from_start, from_size, from_max);
+  }
+
+  double Gaussian1D::range(void) const {
+    return _radius;
+  }
+
+  SAMPLE Gaussian1D::eval(double x) const {
+    return exp(-sqr(x) * _r_2sigma2);
+  }
+
+  std::string Gaussian1D::name(void) const {
+    return "Gaussian";
+  }
+
 }
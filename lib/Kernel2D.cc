@@ -17,9 +17,14 @@
 	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <iostream>
+#include <vector>
+#include <type_traits>
+#include <boost/algorithm/string/predicate.hpp>
 #include <stdlib.h>
+#include <string.h>
 #include <omp.h>
 #include "Kernel2D.hh"
+#include "SIMD.hh"
 #include "Destination_items.hh"
 #include "Benchmark.hh"
 
@@ -30,13 +35,15 @@ namespace PhotoFinish {
   Kernel2D::Kernel2D() :
     _width(0), _height(0),
     _centrex(0), _centrey(0),
-    _values(nullptr)
+    _values(nullptr),
+    _luminance(false)
   {}
 
   Kernel2D::Kernel2D(short unsigned int w, short unsigned int h, short unsigned int cx, short unsigned int cy) :
     _width(w), _height(h),
     _centrex(cx), _centrey(cy),
-    _values(nullptr)
+    _values(nullptr),
+    _luminance(false)
   {
     _values = new SAMPLE*[_height];
     for (unsigned short int y = 0; y < _height; y++)
@@ -46,15 +53,42 @@ namespace PhotoFinish {
   Kernel2D::Kernel2D(short unsigned int size, short unsigned int centre) :
     _width(size), _height(size),
     _centrex(centre), _centrey(centre),
-    _values(nullptr)
+    _values(nullptr),
+    _luminance(false)
   {
     _values = new SAMPLE*[_height];
     for (unsigned short int y = 0; y < _height; y++)
       _values[y] = new SAMPLE[_width];
   }
 
-  Kernel2D::ptr Kernel2D::create(const D_sharpen& ds) {
-    return std::make_shared<GaussianSharpen>(ds);
+  Kernel2D::ptr Kernel2D::create(const D_sharpen& ds, bool windowed) {
+    auto kernel = _create(ds, windowed);
+    if (ds.luminance().defined())
+      kernel->set_luminance(ds.luminance());
+    return kernel;
+  }
+
+  Kernel2D::ptr Kernel2D::_create(const D_sharpen& ds, bool windowed) {
+    std::string method = ds.method();
+    if (boost::iequals(method, "recursive")) {
+      if (!windowed)
+	return std::make_shared<RecursiveUnsharpMask>(ds);
+      std::cerr << "Recursive blur needs the whole image, using an unsharp mask instead." << std::endl;
+      return std::make_shared<UnsharpMask>(ds);
+    }
+
+    if ((method.length() == 0) || boost::iequals(method, "unsharp")) {
+      // Only swap in the recursive filter when cutting the Gaussian off at the radius makes little difference
+      if (!windowed && ds.radius().defined() && ds.sigma().defined()
+	  && (ds.radius() > RecursiveUnsharpMask::min_radius) && (ds.radius() >= 3 * ds.sigma()))
+	return std::make_shared<RecursiveUnsharpMask>(ds);
+      return std::make_shared<UnsharpMask>(ds);
+    }
+
+    if (boost::iequals(method, "kernel"))
+      return std::make_shared<GaussianSharpen>(ds);
+
+    throw DestinationError("sharpen.method", method);
   }
 
   Kernel2D::~Kernel2D() {
@@ -67,124 +101,199 @@ namespace PhotoFinish {
   }
 
   template <typename T, int channels>
-  void Kernel2D::convolve_type_channels(Image::ptr src, Image::ptr dest, bool can_free) {
-    Timer timer;
-    long long pixel_count = 0;
-    timer.start();
+  void Kernel2D::convolve_type_channels(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    bool show_progress = !dest->is_lazy();
+    ImageView src_view(src, first_row_needed(first), last_row_needed(last - 1, src->height()) + 1);
+    const unsigned int width = src->width();
+    const unsigned int stride = src->format().total_channels();
+    const size_t row_size = (size_t)width * stride * sizeof(T);
+
+    // Weights divided by their sum, for pixels whose window is entirely inside the image
+    const unsigned int taps = (unsigned int)_width * _height;
+    std::vector<SAMPLE> norm(taps);
+    {
+      SAMPLE total = 0;
+      for (short unsigned int ky = 0; ky < _height; ky++)
+	for (short unsigned int kx = 0; kx < _width; kx++)
+	  total += _values[ky][kx];
+      SAMPLE scale = fabs(total) > 1e-5 ? 1.0 / total : 1.0;
+      for (short unsigned int ky = 0; ky < _height; ky++)
+	for (short unsigned int kx = 0; kx < _width; kx++)
+	  norm[(ky * _width) + kx] = _values[ky][kx] * scale;
+    }
+    unsigned int x_start = _centrex, x_end = width >= _width ? width - _width + _centrex + 1 : 0;
+    if (x_end < x_start)
+      x_end = x_start;
 
-#pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int y = 0; y < src->height(); y++) {
-      dest->check_row_alloc(y);
-      T *out = dest->row(y)->data<T>();
-      short unsigned int ky_start = y < _centrey ? _centrey - y : 0;
-      short unsigned int ky_end = y > src->height() - _height + _centrey ? src->height() + _centrey - y : _height;
-
-      for (unsigned int x = 0; x < src->width(); x++) {
-	short unsigned int kx_start = x < _centrex ? _centrex - x : 0;
-	short unsigned int kx_end = x > src->width() - _width + _centrex ? src->width() + _centrex - x : _width;
-
-	SAMPLE temp[channels], weight = 0;
-	for (unsigned char c = 0; c < channels; c++)
-	  temp[c] = 0;
-
-	for (short unsigned int ky = ky_start; ky < ky_end; ky++) {
-	  const SAMPLE *kp = _values[ky] + kx_start;
-	  T *inp = src->row(y + ky - _centrey)->data<T>(x + kx_start - _centrex);
-	  for (short unsigned int kx = kx_start; kx < kx_end; kx++, kp++) {
-	    weight += *kp;
-	    for (unsigned char c = 0; c < channels; c++, inp++)
-	      temp[c] += (*inp) * (*kp);
-	    pixel_count++;
+#pragma omp parallel
+    {
+      // Each thread reuses its input pointers and sums for the interior of rows
+      std::vector<const T*> inp(taps);
+      std::vector<SAMPLE> sums(((size_t)x_end - x_start) * channels);
+
+#pragma omp for schedule(dynamic, 1)
+      for (unsigned int y = first; y < last; y++) {
+	T *out = dest->write_row_data<T>(y);
+	short unsigned int ky_start = y < _centrey ? _centrey - y : 0;
+	short unsigned int ky_end = y > src->height() - _height + _centrey ? src->height() + _centrey - y : _height;
+	bool interior = (ky_start == 0) && (ky_end == _height) && (x_end > x_start);
+	if (stride > channels)
+	  memcpy(out, src_view.data<T>(y), row_size);
+
+	// Pixels near the edges use only the part of the kernel over the image, and divide by its sum
+	auto border_pixel = [&](unsigned int x) {
+	  short unsigned int kx_start = x < _centrex ? _centrex - x : 0;
+	  short unsigned int kx_end = x > width - _width + _centrex ? width + _centrex - x : _width;
+
+	  SAMPLE temp[channels], weight = 0;
+	  for (unsigned char c = 0; c < channels; c++)
+	    temp[c] = 0;
+
+	  for (short unsigned int ky = ky_start; ky < ky_end; ky++) {
+	    const SAMPLE *kp = _values[ky] + kx_start;
+	    const T *in = src_view.data<T>(y + ky - _centrey, x + kx_start - _centrex);
+	    for (short unsigned int kx = kx_start; kx < kx_end; kx++, kp++, in += stride) {
+	      weight += *kp;
+	      for (unsigned char c = 0; c < channels; c++)
+		temp[c] += in[c] * (*kp);
+	    }
 	  }
-	}
-	if (fabs(weight) > 1e-5) {
-	  weight = 1.0 / weight;
+	  if (fabs(weight) > 1e-5) {
+	    weight = 1.0 / weight;
+	    for (unsigned char c = 0; c < channels; c++)
+	      temp[c] *= weight;
+	  }
+	  T *o = out + ((size_t)x * stride);
 	  for (unsigned char c = 0; c < channels; c++)
-	    temp[c] *= weight;
-	}
-	for (unsigned char c = 0; c < channels; c++, out++)
-	  *out = limitval<T>(temp[c]);
-      }
-
-      if (can_free)
-	src->free_row(y);
+	    o[c] = limitval<T>(temp[c]);
+	};
+
+	if (interior) {
+	  for (unsigned int x = 0; x < x_start; x++)
+	    border_pixel(x);
+
+	  // Every tap is a weighted row of values shifted by its column, summed across x with no bounds checks
+	  unsigned int count = x_end - x_start;
+	  size_t n = (size_t)count * channels;
+	  for (short unsigned int ky = 0; ky < _height; ky++)
+	    for (short unsigned int kx = 0; kx < _width; kx++)
+	      inp[(ky * _width) + kx] = src_view.data<T>(y + ky - _centrey, x_start + kx - _centrex);
+
+	  T *o = out + ((size_t)x_start * stride);
+	  if (stride > channels) {
+	    // Only some channels of each pixel
+	    for (size_t i = 0; i < n; i++)
+	      sums[i] = 0;
+	    for (unsigned int j = 0; j < taps; j++) {
+	      const T *in = inp[j];
+	      SAMPLE w = norm[j];
+	      SAMPLE *sum = sums.data();
+	      for (unsigned int x = 0; x < count; x++, in += stride, sum += channels)
+		for (unsigned char c = 0; c < channels; c++)
+		  sum[c] += in[c] * w;
+	    }
+
+	    const SAMPLE *sum = sums.data();
+	    for (unsigned int x = 0; x < count; x++, o += stride, sum += channels)
+	      for (unsigned char c = 0; c < channels; c++)
+		o[c] = limitval<T>(sum[c]);
+	  } else if constexpr (std::is_same<T, float>::value && std::is_same<SAMPLE, float>::value) {
+	    SIMD::weighted_sum_rows(inp.data(), norm.data(), taps, o, n);
+	  } else {
+	    {
+	      const T *in = inp[0];
+	      SAMPLE w = norm[0];
+	      for (size_t i = 0; i < n; i++)
+		sums[i] = in[i] * w;
+	    }
+	    for (unsigned int j = 1; j < taps; j++) {
+	      const T *in = inp[j];
+	      SAMPLE w = norm[j];
+	      for (size_t i = 0; i < n; i++)
+		sums[i] += in[i] * w;
+	    }
+
+	    for (size_t i = 0; i < n; i++)
+	      o[i] = limitval<T>(sums[i]);
+	  }
 
-      if (omp_get_thread_num() == 0)
-	std::cerr << "\r\tConvolved " << y + 1 << " of " << src->height() << " rows";
-    }
-    timer.stop();
+	  for (unsigned int x = x_end; x < width; x++)
+	    border_pixel(x);
+	} else
+	  for (unsigned int x = 0; x < width; x++)
+	    border_pixel(x);
 
-    std::cerr << "\r\tConvolved " << src->height() << " of " << src->height() << " rows." << std::endl;
+	if (releaser != nullptr)
+	  releaser->finish(y, [this](unsigned int ny) { return first_row_needed(ny); });
 
-    if (benchmark_mode) {
-      std::cerr << std::setprecision(2) << std::fixed;
-      std::cerr << "Benchmark: Convolved " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second" << std::endl;
+	if (show_progress && (omp_get_thread_num() == 0))
+	  std::cerr << "\r\tConvolved " << y + 1 << " of " << src->height() << " rows";
+      }
     }
-
   }
 
   template <typename T>
-  void Kernel2D::convolve_type(Image::ptr src, Image::ptr dest, bool can_free) {
-    unsigned char channels = src->format().total_channels();
+  void Kernel2D::convolve_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    unsigned char channels = _convolved_channels(src->format());
     switch (channels) {
     case 1:
-      convolve_type_channels<T, 1>(src, dest, can_free);
+      convolve_type_channels<T, 1>(src, dest, first, last, releaser);
       break;
 
     case 2:
-      convolve_type_channels<T, 2>(src, dest, can_free);
+      convolve_type_channels<T, 2>(src, dest, first, last, releaser);
       break;
 
     case 3:
-      convolve_type_channels<T, 3>(src, dest, can_free);
+      convolve_type_channels<T, 3>(src, dest, first, last, releaser);
       break;
 
     case 4:
-      convolve_type_channels<T, 4>(src, dest, can_free);
+      convolve_type_channels<T, 4>(src, dest, first, last, releaser);
       break;
 
     case 5:
-      convolve_type_channels<T, 5>(src, dest, can_free);
+      convolve_type_channels<T, 5>(src, dest, first, last, releaser);
       break;
 
     case 6:
-      convolve_type_channels<T, 6>(src, dest, can_free);
+      convolve_type_channels<T, 6>(src, dest, first, last, releaser);
       break;
 
     case 7:
-      convolve_type_channels<T, 7>(src, dest, can_free);
+      convolve_type_channels<T, 7>(src, dest, first, last, releaser);
       break;
 
     case 8:
-      convolve_type_channels<T, 8>(src, dest, can_free);
+      convolve_type_channels<T, 8>(src, dest, first, last, releaser);
       break;
 
     case 9:
-      convolve_type_channels<T, 9>(src, dest, can_free);
+      convolve_type_channels<T, 9>(src, dest, first, last, releaser);
       break;
 
     case 10:
-      convolve_type_channels<T, 10>(src, dest, can_free);
+      convolve_type_channels<T, 10>(src, dest, first, last, releaser);
       break;
 
     case 11:
-      convolve_type_channels<T, 11>(src, dest, can_free);
+      convolve_type_channels<T, 11>(src, dest, first, last, releaser);
       break;
 
     case 12:
-      convolve_type_channels<T, 12>(src, dest, can_free);
+      convolve_type_channels<T, 12>(src, dest, first, last, releaser);
       break;
 
     case 13:
-      convolve_type_channels<T, 13>(src, dest, can_free);
+      convolve_type_channels<T, 13>(src, dest, first, last, releaser);
       break;
 
     case 14:
-      convolve_type_channels<T, 14>(src, dest, can_free);
+      convolve_type_channels<T, 14>(src, dest, first, last, releaser);
       break;
 
     case 15:
-      convolve_type_channels<T, 15>(src, dest, can_free);
+      convolve_type_channels<T, 15>(src, dest, first, last, releaser);
       break;
 
     default:
@@ -192,51 +301,141 @@ namespace PhotoFinish {
     }
   }
 
-  Image::ptr Kernel2D::convolve(Image::ptr img, bool can_free) {
-#pragma omp parallel
-    {
-#pragma omp master
-      {
-	std::cerr << "Convolving " << img->width() << "×" << img->height()
-		  << " image with " << _width << "×" << _height
-		  << " kernel using " << omp_get_num_threads() << " threads..." << std::endl;
-      }
-    }
-    auto out = std::make_shared<Image>(img->width(), img->height(), img->format());
-
-    if (img->xres().defined())
-      out->set_xres(img->xres());
-    if (img->yres().defined())
-      out->set_yres(img->yres());
-
-    switch (img->format().bytes_per_channel()) {
+  void Kernel2D::convolve_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    switch (src->format().bytes_per_channel()) {
     case 1:
-      convolve_type<unsigned char>(img, out, can_free);
+      convolve_type<unsigned char>(src, dest, first, last, releaser);
       break;
 
     case 2:
-      convolve_type<short unsigned int>(img, out, can_free);
+      if (src->format().is_fp())
+	convolve_type<half>(src, dest, first, last, releaser);
+      else
+	convolve_type<short unsigned int>(src, dest, first, last, releaser);
       break;
 
     case 4:
-      if (img->format().is_fp())
-	convolve_type<float>(img, out, can_free);
+      if (src->format().is_fp())
+	convolve_type<float>(src, dest, first, last, releaser);
       else
-	convolve_type<unsigned int>(img, out, can_free);
+	convolve_type<unsigned int>(src, dest, first, last, releaser);
       break;
 
     case 8:
-      if (img->format().is_fp())
-	convolve_type<double>(img, out, can_free);
+      if (src->format().is_fp())
+	convolve_type<double>(src, dest, first, last, releaser);
       else
-	convolve_type<unsigned long long>(img, out, can_free);
+	convolve_type<unsigned long long>(src, dest, first, last, releaser);
       break;
 
     }
+  }
+
+  Image::ptr Kernel2D::_new_image(Image::ptr img) const {
+    auto out = std::make_shared<Image>(img->width(), img->height(), img->format());
+
+    if (img->xres().defined())
+      out->set_xres(img->xres());
+    if (img->yres().defined())
+      out->set_yres(img->yres());
+
+    return out;
+  }
+
+  unsigned int Kernel2D::_convolved_channels(const CMS::Format& format) const {
+    if (_luminance)
+      switch (format.colour_model()) {
+      case CMS::ColourModel::Lab:
+      case CMS::ColourModel::LabV2:
+      case CMS::ColourModel::Greyscale:
+	return 1;
+
+      default:
+	break;
+      }
+
+    return format.total_channels();
+  }
+
+  Image::ptr Kernel2D::convolve(Image::ptr img, bool can_free) {
+#pragma omp parallel
+    {
+#pragma omp master
+      {
+	std::cerr << "Convolving " << img->width() << "×" << img->height()
+		  << " image with " << _width << "×" << _height
+		  << " kernel using " << omp_get_num_threads() << " threads"
+		  << (_convolved_channels(img->format()) < img->format().total_channels() ? " (lightness only)" : "")
+		  << "..." << std::endl;
+      }
+    }
+    auto out = _new_image(img);
+    img->generate_all();
+
+    Timer timer;
+    timer.start();
+    if (can_free) {
+      RowReleaser releaser(img, img->height());
+      convolve_rows(img, out, 0, img->height(), &releaser);
+    } else
+      convolve_rows(img, out, 0, img->height(), nullptr);
+    timer.stop();
+
+    std::cerr << "\r\tConvolved " << img->height() << " of " << img->height() << " rows." << std::endl;
+
+    if (benchmark_mode) {
+      // The kernel is clipped at the edges, so count the taps in each direction separately
+      long long rows = 0, cols = 0;
+      for (unsigned int y = 0; y < img->height(); y++)
+	rows += last_row_needed(y, img->height()) + 1 - first_row_needed(y);
+      for (unsigned int x = 0; x < img->width(); x++)
+	cols += (x + _width - _centrex < img->width() ? x + _width - _centrex : img->width()) - (x > _centrex ? x - _centrex : 0);
+      long long pixel_count = rows * cols;
+      std::cerr << std::setprecision(2) << std::fixed;
+      std::cerr << "Benchmark: Convolved " << pixel_count << " pixels in " << timer << " = " << (pixel_count / timer.elapsed() / 1e+6) << " Mpixels/second" << std::endl;
+    }
 
     return out;
   }
 
+  //! Produces the rows of a convolved image as they are needed
+  /*!
+    Only a window of source rows the height of the kernel is kept.
+   */
+  class Kernel2DGenerator : public RowGenerator {
+  private:
+    Kernel2D::ptr _kernel;
+    Image::ptr _src;
+    unsigned int _freed;
+
+  public:
+    Kernel2DGenerator(Kernel2D::ptr kernel, Image::ptr src) :
+      _kernel(kernel), _src(src),
+      _freed(0)
+    {}
+
+    void generate(Image& dest, unsigned int first, unsigned int last) {
+      _src->check_row_generated(_kernel->last_row_needed(last - 1, _src->height()));
+      _kernel->convolve_rows(_src, dest.shared_from_this(), first, last, nullptr);
+
+      unsigned int needed = last < dest.height() ? _kernel->first_row_needed(last) : _src->height();
+      for (; _freed < needed; _freed++)
+	_src->free_row(_freed);
+    }
+
+  }; // class Kernel2DGenerator
+
+  Image::ptr Kernel2D::convolve_lazy(Image::ptr img) {
+    std::cerr << "Convolving " << img->width() << "×" << img->height()
+	      << " image with " << _width << "×" << _height
+	      << " kernel as rows are needed"
+	      << (_convolved_channels(img->format()) < img->format().total_channels() ? " (lightness only)" : "")
+	      << "." << std::endl;
+    auto out = _new_image(img);
+    out->set_generator(std::make_shared<Kernel2DGenerator>(shared_from_this(), img));
+    return out;
+  }
+
 
 
   GaussianSharpen::GaussianSharpen()
@@ -263,4 +462,329 @@ namespace PhotoFinish {
     _values[_centrey][_centrex] = -2.0 * total;
   }
 
+
+
+
+  UnsharpMask::UnsharpMask(const D_sharpen& ds) :
+    Kernel2D()
+  {
+    if (!ds.radius().defined())
+      throw Uninitialised("UnsharpMask", "sharpen.radius");
+
+    if (!ds.sigma().defined())
+      throw Uninitialised("UnsharpMask", "sharpen.sigma");
+
+    unsigned int radius = ceil(ds.radius());
+    _width = _height = 1 + (2 * radius);
+    _centrex = _centrey = radius;
+
+    double sigma_sqr = fabs(ds.sigma()) > 1e-5 ? sqr(ds.sigma()) : 1e-5;
+    _weights.resize(_width);
+    SAMPLE sum = 0;
+    for (unsigned int k = 0; k < _width; k++)
+      sum += _weights[k] = exp(sqr((int)k - (int)radius) / (-2.0 * sigma_sqr));
+
+    _sum2 = sqr(sum);
+    _edge_scale = (_sum2 + 1) / _sum2;
+    _amount = ds.amount().defined() ? (SAMPLE)ds.amount() : _sum2 / (_sum2 + 1);
+  }
+
+  template <typename T>
+  void UnsharpMask::convolve_rows_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    bool show_progress = !dest->is_lazy();
+    const unsigned int channels = _convolved_channels(src->format()), stride = src->format().total_channels();
+    const unsigned int width = src->width(), height = src->height(), radius = _centrex;
+    const size_t row_values = (size_t)width * channels;
+    ImageView src_view(src, first_row_needed(first), last_row_needed(last - 1, height) + 1);
+
+#pragma omp parallel
+    {
+      std::vector<SAMPLE> column(row_values);
+
+#pragma omp for schedule(dynamic, 1)
+      for (unsigned int y = first; y < last; y++) {
+	// Vertical pass, rows past the edges are left out
+	unsigned int top = first_row_needed(y), bottom = last_row_needed(y, height);
+	SAMPLE v_total = 0;
+	for (size_t i = 0; i < row_values; i++)
+	  column[i] = 0;
+	for (unsigned int ny = top; ny <= bottom; ny++) {
+	  SAMPLE w = _weights[ny + radius - y];
+	  v_total += w;
+	  const T *in = src_view.data<T>(ny);
+	  if (stride > channels) {
+	    SAMPLE *col = column.data();
+	    for (unsigned int x = 0; x < width; x++, in += stride, col += channels)
+	      for (unsigned char c = 0; c < channels; c++)
+		col[c] += in[c] * w;
+	  } else
+	    for (size_t i = 0; i < row_values; i++)
+	      column[i] += in[i] * w;
+	}
+
+	// Horizontal pass, then add the difference from the blur to the original
+	const T *orig = src_view.data<T>(y);
+	T *out = dest->write_row_data<T>(y);
+	if (stride > channels)
+	  memcpy(out, orig, (size_t)width * stride * sizeof(T));
+	SAMPLE blur[16];
+	for (unsigned int x = 0; x < width; x++) {
+	  unsigned int left = x > radius ? x - radius : 0;
+	  unsigned int right = x + radius < width ? x + radius : width - 1;
+	  SAMPLE h_total = 0;
+	  for (unsigned char c = 0; c < channels; c++)
+	    blur[c] = 0;
+	  for (unsigned int nx = left; nx <= right; nx++) {
+	    SAMPLE w = _weights[nx + radius - x];
+	    h_total += w;
+	    const SAMPLE *in = column.data() + (nx * channels);
+	    for (unsigned char c = 0; c < channels; c++)
+	      blur[c] += in[c] * w;
+	  }
+
+	  SAMPLE sum = v_total * h_total, scale = 1.0 / sum;
+	  SAMPLE amount = _amount;
+	  if ((left + radius != x) || (right != x + radius) || (top + radius != y) || (bottom != y + radius))
+	    amount *= _edge_scale * sum / ((2 * _sum2) + 1 - sum);
+
+	  for (unsigned char c = 0; c < channels; c++) {
+	    SAMPLE v = orig[c];
+	    out[c] = limitval<T>(v + (amount * (v - (blur[c] * scale))));
+	  }
+	  orig += stride;
+	  out += stride;
+	}
+
+	if (releaser != nullptr)
+	  releaser->finish(y, [this](unsigned int ny) { return first_row_needed(ny); });
+
+	if (show_progress && (omp_get_thread_num() == 0))
+	  std::cerr << "\r\tConvolved " << y + 1 << " of " << src->height() << " rows";
+      }
+    }
+  }
+
+  void UnsharpMask::convolve_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    switch (src->format().bytes_per_channel()) {
+    case 1:
+      convolve_rows_type<unsigned char>(src, dest, first, last, releaser);
+      break;
+
+    case 2:
+      if (src->format().is_fp())
+	convolve_rows_type<half>(src, dest, first, last, releaser);
+      else
+	convolve_rows_type<short unsigned int>(src, dest, first, last, releaser);
+      break;
+
+    case 4:
+      if (src->format().is_fp())
+	convolve_rows_type<float>(src, dest, first, last, releaser);
+      else
+	convolve_rows_type<unsigned int>(src, dest, first, last, releaser);
+      break;
+
+    case 8:
+      if (src->format().is_fp())
+	convolve_rows_type<double>(src, dest, first, last, releaser);
+      else
+	convolve_rows_type<unsigned long long>(src, dest, first, last, releaser);
+      break;
+
+    }
+  }
+
+
+
+
+  RecursiveUnsharpMask::RecursiveUnsharpMask(const D_sharpen& ds) :
+    Kernel2D()
+  {
+    if (!ds.radius().defined())
+      throw Uninitialised("RecursiveUnsharpMask", "sharpen.radius");
+
+    if (!ds.sigma().defined())
+      throw Uninitialised("RecursiveUnsharpMask", "sharpen.sigma");
+
+    unsigned int radius = ceil(ds.radius());
+    _width = _height = 1 + (2 * radius);
+    _centrex = _centrey = radius;
+
+    // Coefficients from Young & van Vliet, "Recursive implementation of the Gaussian filter" (1995).
+    // Their formula for q gives a blur about 10% too wide, so instead find the q whose
+    // forward and backward passes together have a variance of sigma squared.
+    double sigma = ds.sigma() < 0.5 ? 0.5 : (double)ds.sigma();
+    double B, b1, b2, b3;
+    double q_low = 0, q_high = 2 * sigma;
+    for (int i = 0; i < 50; i++) {
+      double q = (q_low + q_high) * 0.5;
+      double q2 = sqr(q), q3 = q2 * q;
+      double b0 = 1.57825 + (2.44413 * q) + (1.4281 * q2) + (0.422205 * q3);
+      b1 = ((2.44413 * q) + (2.85619 * q2) + (1.26661 * q3)) / b0;
+      b2 = -((1.4281 * q2) + (1.26661 * q3)) / b0;
+      b3 = (0.422205 * q3) / b0;
+      B = 1 - (b1 + b2 + b3);
+
+      double mean = (b1 + (2 * b2) + (3 * b3)) / B;
+      double variance = 2 * (((b1 + (4 * b2) + (9 * b3)) / B) + sqr(mean));
+      if (variance < sqr(sigma))
+	q_low = q;
+      else
+	q_high = q;
+    }
+    _B = B;
+    _b1 = b1;
+    _b2 = b2;
+    _b3 = b3;
+
+    // The same amount as a GaussianSharpen kernel with this radius and sigma
+    SAMPLE sum = 0;
+    for (int k = -(int)radius; k <= (int)radius; k++)
+      sum += exp(sqr(k) / (-2.0 * sqr(sigma)));
+    SAMPLE sum2 = sqr(sum);
+    _amount = ds.amount().defined() ? (SAMPLE)ds.amount() : sum2 / (sum2 + 1);
+  }
+
+  size_t RecursiveUnsharpMask::extra_memory(unsigned int width, unsigned int height, const CMS::Format& format) const {
+    return (size_t)width * height * _convolved_channels(format) * sizeof(SAMPLE);
+  }
+
+  Image::ptr RecursiveUnsharpMask::convolve_lazy(Image::ptr img) {
+    std::cerr << "Recursive blur needs the whole image." << std::endl;
+    return convolve(img, true);
+  }
+
+  template <typename T>
+  void RecursiveUnsharpMask::convolve_rows_type(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    const unsigned int channels = _convolved_channels(src->format()), stride = src->format().total_channels();
+    const unsigned int width = src->width(), height = src->height();
+    const size_t row_values = (size_t)width * channels;
+
+    // The blurred image is one slab, so that it is counted by MemoryBudget and
+    // kept in a temporary file when it's too big
+    size_t blur_size = row_values * height * sizeof(SAMPLE);
+    ImageSlab slab(blur_size, ImageSlab::want_files(blur_size));
+    SAMPLE *blur = (SAMPLE*)slab.acquire_row(0, blur_size);
+
+    // Horizontal passes, forwards then backwards along each row, starting from the edge pixel as if it carried on
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int y = 0; y < height; y++) {
+      const T *in = src->row_data<T>(y);
+      SAMPLE *row = blur + (y * row_values);
+      for (unsigned char c = 0; c < channels; c++) {
+	SAMPLE w1 = in[c], w2 = w1, w3 = w1;
+	const T *inp = in + c;
+	for (size_t i = c; i < row_values; i += channels, inp += stride) {
+	  SAMPLE w0 = (_B * *inp) + (_b1 * w1) + (_b2 * w2) + (_b3 * w3);
+	  row[i] = w0;
+	  w3 = w2;
+	  w2 = w1;
+	  w1 = w0;
+	}
+
+	w1 = w2 = w3 = row[row_values - channels + c];
+	for (size_t i = row_values - channels + c; i < row_values; i -= channels) {
+	  SAMPLE w0 = (_B * row[i]) + (_b1 * w1) + (_b2 * w2) + (_b3 * w3);
+	  row[i] = w0;
+	  w3 = w2;
+	  w2 = w1;
+	  w1 = w0;
+	}
+      }
+    }
+
+    // Vertical passes over strips of columns, each thread working down and up one strip at a time
+    const size_t strip_values = 256;
+    const unsigned int num_strips = (row_values + strip_values - 1) / strip_values;
+#pragma omp parallel
+    {
+      SAMPLE w1[strip_values], w2[strip_values], w3[strip_values];
+
+#pragma omp for schedule(dynamic, 1)
+      for (unsigned int strip = 0; strip < num_strips; strip++) {
+	size_t offset = strip * strip_values;
+	size_t n = row_values - offset < strip_values ? row_values - offset : strip_values;
+
+	for (size_t i = 0; i < n; i++)
+	  w1[i] = w2[i] = w3[i] = blur[offset + i];
+	for (unsigned int y = 0; y < height; y++) {
+	  SAMPLE *p = blur + (y * row_values) + offset;
+	  for (size_t i = 0; i < n; i++) {
+	    SAMPLE w0 = (_B * p[i]) + (_b1 * w1[i]) + (_b2 * w2[i]) + (_b3 * w3[i]);
+	    p[i] = w0;
+	    w3[i] = w2[i];
+	    w2[i] = w1[i];
+	    w1[i] = w0;
+	  }
+	}
+
+	for (size_t i = 0; i < n; i++)
+	  w1[i] = w2[i] = w3[i] = blur[((height - 1) * row_values) + offset + i];
+	for (unsigned int y = height; y > 0; y--) {
+	  SAMPLE *p = blur + ((y - 1) * row_values) + offset;
+	  for (size_t i = 0; i < n; i++) {
+	    SAMPLE w0 = (_B * p[i]) + (_b1 * w1[i]) + (_b2 * w2[i]) + (_b3 * w3[i]);
+	    p[i] = w0;
+	    w3[i] = w2[i];
+	    w2[i] = w1[i];
+	    w1[i] = w0;
+	  }
+	}
+      }
+    }
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int y = first; y < last; y++) {
+      const T *orig = src->row_data<T>(y);
+      const SAMPLE *b = blur + (y * row_values);
+      T *out = dest->write_row_data<T>(y);
+      if (stride > channels) {
+	memcpy(out, orig, (size_t)width * stride * sizeof(T));
+	for (unsigned int x = 0; x < width; x++, orig += stride, out += stride, b += channels)
+	  for (unsigned char c = 0; c < channels; c++) {
+	    SAMPLE v = orig[c];
+	    out[c] = limitval<T>(v + (_amount * (v - b[c])));
+	  }
+      } else
+	for (size_t i = 0; i < row_values; i++) {
+	  SAMPLE v = orig[i];
+	  out[i] = limitval<T>(v + (_amount * (v - b[i])));
+	}
+
+      // Every output row needs the whole source, so nothing is freed until the end
+      if (releaser != nullptr)
+	releaser->finish(y, [](unsigned int ny) { return 0U; });
+    }
+  }
+
+  void RecursiveUnsharpMask::convolve_rows(Image::ptr src, Image::ptr dest, unsigned int first, unsigned int last, RowReleaser* releaser) {
+    switch (src->format().bytes_per_channel()) {
+    case 1:
+      convolve_rows_type<unsigned char>(src, dest, first, last, releaser);
+      break;
+
+    case 2:
+      if (src->format().is_fp())
+	convolve_rows_type<half>(src, dest, first, last, releaser);
+      else
+	convolve_rows_type<short unsigned int>(src, dest, first, last, releaser);
+      break;
+
+    case 4:
+      if (src->format().is_fp())
+	convolve_rows_type<float>(src, dest, first, last, releaser);
+      else
+	convolve_rows_type<unsigned int>(src, dest, first, last, releaser);
+      break;
+
+    case 8:
+      if (src->format().is_fp())
+	convolve_rows_type<double>(src, dest, first, last, releaser);
+      else
+	convolve_rows_type<unsigned long long>(src, dest, first, last, releaser);
+      break;
+
+    }
+  }
+
 }
@@ -0,0 +1,36 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "MemoryBudget.hh"
+
+namespace PhotoFinish {
+
+  std::atomic<size_t> MemoryBudget::_in_use(0);
+  size_t MemoryBudget::_limit = 0;
+  thread_local std::atomic<size_t>* MemoryBudget::_account = nullptr;
+  std::atomic<bool> MemoryBudget::_waiting(false);
+  std::function<void(void)> MemoryBudget::_waker;
+
+  bool MemoryBudget::fits(size_t bytes, size_t reserved) {
+    if (_limit == 0)
+      return true;
+
+    return in_use() + reserved + bytes <= _limit;
+  }
+
+}; // namespace PhotoFinish
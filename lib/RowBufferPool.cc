@@ -0,0 +1,116 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <vector>
+#include "RowBufferPool.hh"
+#include "ImageSlab.hh"
+#include "MemoryBudget.hh"
+#include "Exception.hh"
+
+namespace PhotoFinish {
+
+  size_t RowBufferPool::max_cached = 16 << 20;
+
+  // Rows are rounded up to a multiple of the cache line size until they
+  // are 8 lines long. Past that, each doubling of size is split into four
+  // classes, so no more than a quarter of a buffer is wasted.
+  static unsigned int size_class(size_t size) {
+    size_t unit = ImageSlab::row_alignment;
+    unsigned int band = 0;
+    while (unit * 8 < size) {
+      unit <<= 1;
+      band++;
+    }
+    return (band * 4) + ((size + unit - 1) / unit) - 1;
+  }
+
+  static size_t class_size(unsigned int sc) {
+    unsigned int band = sc < 8 ? 0 : (sc - 4) / 4;
+    return (ImageSlab::row_alignment << band) * (sc - (band * 4) + 1);
+  }
+
+  // The free lists of one thread, which give their buffers back when the thread ends
+  class FreeLists {
+  private:
+    std::vector<std::vector<unsigned char*>> _lists;
+    size_t _cached;
+
+  public:
+    FreeLists() :
+      _cached(0)
+    {}
+
+    ~FreeLists() {
+      for (unsigned int sc = 0; sc < _lists.size(); sc++)
+	for (auto buffer : _lists[sc]) {
+	  free(buffer);
+	  MemoryBudget::freed(class_size(sc));
+	}
+    }
+
+    unsigned char* take(unsigned int sc) {
+      if ((sc >= _lists.size()) || _lists[sc].empty())
+	return nullptr;
+
+      unsigned char *buffer = _lists[sc].back();
+      _lists[sc].pop_back();
+      _cached -= class_size(sc);
+      return buffer;
+    }
+
+    bool give(unsigned int sc, unsigned char* buffer) {
+      if (_cached + class_size(sc) > RowBufferPool::max_cached)
+	return false;
+
+      if (sc >= _lists.size())
+	_lists.resize(sc + 1);
+      _lists[sc].push_back(buffer);
+      _cached += class_size(sc);
+      return true;
+    }
+
+  }; // class FreeLists
+
+  static thread_local FreeLists free_lists;
+
+  unsigned char* RowBufferPool::acquire(size_t size) {
+    unsigned int sc = size_class(size);
+    unsigned char *buffer = free_lists.take(sc);
+    if (buffer != nullptr)
+      return buffer;
+
+    buffer = (unsigned char*)aligned_alloc(ImageSlab::row_alignment, class_size(sc));
+    if (buffer == nullptr)
+      throw MemAllocError("Could not allocate a row buffer.");
+    MemoryBudget::allocated(class_size(sc));
+    return buffer;
+  }
+
+  void RowBufferPool::release(unsigned char* buffer, size_t size) {
+    if (buffer == nullptr)
+      return;
+
+    unsigned int sc = size_class(size);
+    if (!free_lists.give(sc, buffer)) {
+      free(buffer);
+      MemoryBudget::freed(class_size(sc));
+    }
+  }
+
+}; // namespace PhotoFinish
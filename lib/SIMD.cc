@@ -0,0 +1,319 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/algorithm/string/predicate.hpp>
+#include "SIMD.hh"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAZ_X86_SIMD
+#endif
+
+namespace PhotoFinish {
+
+  std::ostream& operator<< (std::ostream& out, SIMDLevel level) {
+    switch (level) {
+    case SIMDLevel::Scalar:
+      out << "scalar";
+      break;
+
+    case SIMDLevel::SSE4_2:
+      out << "SSE4.2";
+      break;
+
+    case SIMDLevel::AVX2:
+      out << "AVX2";
+      break;
+
+    case SIMDLevel::AVX512:
+      out << "AVX-512";
+      break;
+    }
+    return out;
+  }
+
+  SIMDLevel SIMD::supported(void) {
+#ifdef HAZ_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      return SIMDLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return SIMDLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+      return SIMDLevel::SSE4_2;
+#endif
+    return SIMDLevel::Scalar;
+  }
+
+  SIMDLevel SIMD::_level = SIMD::supported();
+
+  SIMDLevel SIMD::level(void) {
+    return _level;
+  }
+
+  void SIMD::set_level(SIMDLevel level) {
+    SIMDLevel best = supported();
+    _level = level < best ? level : best;
+  }
+
+  bool SIMD::parse_level(const std::string& name, SIMDLevel& level) {
+    if (boost::iequals(name, "scalar") || boost::iequals(name, "none"))
+      level = SIMDLevel::Scalar;
+    else if (boost::iequals(name, "sse4.2") || boost::iequals(name, "sse"))
+      level = SIMDLevel::SSE4_2;
+    else if (boost::iequals(name, "avx2"))
+      level = SIMDLevel::AVX2;
+    else if (boost::iequals(name, "avx512") || boost::iequals(name, "avx-512"))
+      level = SIMDLevel::AVX512;
+    else
+      return false;
+    return true;
+  }
+
+  static void weighted_sum_rows_scalar(const float* const* rows, const float* weights, unsigned int taps, float* out, size_t start, size_t n) {
+    for (size_t i = start; i < n; i++) {
+      float sum = 0;
+      for (unsigned int j = 0; j < taps; j++)
+	sum += rows[j][i] * weights[j];
+      out[i] = sum;
+    }
+  }
+
+  static void convolve_pixel_scalar(const float* in, float* out, unsigned int channels, unsigned int size, const float* weights) {
+    float temp[16];
+    for (unsigned int c = 0; c < channels; c++)
+      temp[c] = 0;
+    for (unsigned int j = 0; j < size; j++, weights++)
+      for (unsigned int c = 0; c < channels; c++, in++)
+	temp[c] += (*in) * (*weights);
+    for (unsigned int c = 0; c < channels; c++)
+      out[c] = temp[c];
+  }
+
+#ifdef HAZ_X86_SIMD
+  // Four vectors at a time, so that the additions of different taps overlap
+  __attribute__((target("sse4.2")))
+  static void weighted_sum_rows_sse(const float* const* rows, const float* weights, unsigned int taps, float* out, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+      for (unsigned int j = 0; j < taps; j++) {
+	__m128 w = _mm_set1_ps(weights[j]);
+	const float *in = rows[j] + i;
+	acc0 = _mm_add_ps(acc0, _mm_mul_ps(w, _mm_loadu_ps(in)));
+	acc1 = _mm_add_ps(acc1, _mm_mul_ps(w, _mm_loadu_ps(in + 4)));
+	acc2 = _mm_add_ps(acc2, _mm_mul_ps(w, _mm_loadu_ps(in + 8)));
+	acc3 = _mm_add_ps(acc3, _mm_mul_ps(w, _mm_loadu_ps(in + 12)));
+      }
+      _mm_storeu_ps(out + i, acc0);
+      _mm_storeu_ps(out + i + 4, acc1);
+      _mm_storeu_ps(out + i + 8, acc2);
+      _mm_storeu_ps(out + i + 12, acc3);
+    }
+    for (; i + 4 <= n; i += 4) {
+      __m128 acc = _mm_setzero_ps();
+      for (unsigned int j = 0; j < taps; j++)
+	acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[j]), _mm_loadu_ps(rows[j] + i)));
+      _mm_storeu_ps(out + i, acc);
+    }
+    weighted_sum_rows_scalar(rows, weights, taps, out, i, n);
+  }
+
+  __attribute__((target("avx2,fma")))
+  static void weighted_sum_rows_avx2(const float* const* rows, const float* weights, unsigned int taps, float* out, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+      __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+      for (unsigned int j = 0; j < taps; j++) {
+	__m256 w = _mm256_set1_ps(weights[j]);
+	const float *in = rows[j] + i;
+	acc0 = _mm256_fmadd_ps(w, _mm256_loadu_ps(in), acc0);
+	acc1 = _mm256_fmadd_ps(w, _mm256_loadu_ps(in + 8), acc1);
+	acc2 = _mm256_fmadd_ps(w, _mm256_loadu_ps(in + 16), acc2);
+	acc3 = _mm256_fmadd_ps(w, _mm256_loadu_ps(in + 24), acc3);
+      }
+      _mm256_storeu_ps(out + i, acc0);
+      _mm256_storeu_ps(out + i + 8, acc1);
+      _mm256_storeu_ps(out + i + 16, acc2);
+      _mm256_storeu_ps(out + i + 24, acc3);
+    }
+    for (; i + 8 <= n; i += 8) {
+      __m256 acc = _mm256_setzero_ps();
+      for (unsigned int j = 0; j < taps; j++)
+	acc = _mm256_fmadd_ps(_mm256_set1_ps(weights[j]), _mm256_loadu_ps(rows[j] + i), acc);
+      _mm256_storeu_ps(out + i, acc);
+    }
+    weighted_sum_rows_scalar(rows, weights, taps, out, i, n);
+  }
+
+  __attribute__((target("avx512f")))
+  static void weighted_sum_rows_avx512(const float* const* rows, const float* weights, unsigned int taps, float* out, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+      __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+      for (unsigned int j = 0; j < taps; j++) {
+	__m512 w = _mm512_set1_ps(weights[j]);
+	const float *in = rows[j] + i;
+	acc0 = _mm512_fmadd_ps(w, _mm512_loadu_ps(in), acc0);
+	acc1 = _mm512_fmadd_ps(w, _mm512_loadu_ps(in + 16), acc1);
+	acc2 = _mm512_fmadd_ps(w, _mm512_loadu_ps(in + 32), acc2);
+	acc3 = _mm512_fmadd_ps(w, _mm512_loadu_ps(in + 48), acc3);
+      }
+      _mm512_storeu_ps(out + i, acc0);
+      _mm512_storeu_ps(out + i + 16, acc1);
+      _mm512_storeu_ps(out + i + 32, acc2);
+      _mm512_storeu_ps(out + i + 48, acc3);
+    }
+    // Masked loads and stores take care of the end of the row
+    for (; i < n; i += 16) {
+      __mmask16 mask = n - i >= 16 ? 0xffff : (1 << (n - i)) - 1;
+      __m512 acc = _mm512_setzero_ps();
+      for (unsigned int j = 0; j < taps; j++)
+	acc = _mm512_fmadd_ps(_mm512_set1_ps(weights[j]), _mm512_maskz_loadu_ps(mask, rows[j] + i), acc);
+      _mm512_mask_storeu_ps(out + i, mask, acc);
+    }
+  }
+
+  // SSE can only do whole pixels of 3 or 4 channels, without reading past the end of the row
+  __attribute__((target("sse4.2")))
+  static bool convolve_row_h_sse(const float* in, float* out, unsigned int out_width, unsigned int channels,
+				 const unsigned int* start, const float* weights, unsigned int taps) {
+    if (channels == 4) {
+      for (unsigned int nx = 0; nx < out_width; nx++, out += 4, weights += taps) {
+	const float *inp = in + (start[nx] * 4), *w = weights;
+	__m128 acc = _mm_setzero_ps();
+	for (unsigned int j = taps; j; j--, inp += 4, w++)
+	  acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(*w), _mm_loadu_ps(inp)));
+	_mm_storeu_ps(out, acc);
+      }
+      return true;
+    }
+
+    if (channels == 3) {
+      for (unsigned int nx = 0; nx < out_width; nx++, out += 3, weights += taps) {
+	const float *inp = in + (start[nx] * 3), *w = weights;
+	__m128 acc = _mm_setzero_ps();
+	for (unsigned int j = taps; j; j--, inp += 3, w++) {
+	  __m128 pixel = _mm_castpd_ps(_mm_load_sd((const double*)inp));
+	  pixel = _mm_insert_ps(pixel, _mm_load_ss(inp + 2), 0x20);
+	  acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(*w), pixel));
+	}
+	_mm_storel_pi((__m64*)out, acc);
+	_mm_store_ss(out + 2, _mm_movehl_ps(acc, acc));
+      }
+      return true;
+    }
+
+    return false;
+  }
+
+  // Each pixel's channels sit in the lanes of one vector, the rest are masked off
+  __attribute__((target("avx2,fma")))
+  static bool convolve_row_h_avx2(const float* in, float* out, unsigned int out_width, unsigned int channels,
+				  const unsigned int* start, const float* weights, unsigned int taps) {
+    if (channels > 8)
+      return false;
+
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(channels), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    for (unsigned int nx = 0; nx < out_width; nx++, out += channels, weights += taps) {
+      const float *inp = in + (start[nx] * channels), *w = weights;
+      __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+      unsigned int j = taps;
+      for (; j >= 2; j -= 2, inp += 2 * channels, w += 2) {
+	acc0 = _mm256_fmadd_ps(_mm256_set1_ps(w[0]), _mm256_maskload_ps(inp, mask), acc0);
+	acc1 = _mm256_fmadd_ps(_mm256_set1_ps(w[1]), _mm256_maskload_ps(inp + channels, mask), acc1);
+      }
+      if (j)
+	acc0 = _mm256_fmadd_ps(_mm256_set1_ps(*w), _mm256_maskload_ps(inp, mask), acc0);
+      _mm256_maskstore_ps(out, mask, _mm256_add_ps(acc0, acc1));
+    }
+    return true;
+  }
+
+  __attribute__((target("avx512f")))
+  static bool convolve_row_h_avx512(const float* in, float* out, unsigned int out_width, unsigned int channels,
+				    const unsigned int* start, const float* weights, unsigned int taps) {
+    if (channels > 16)
+      return false;
+
+    __mmask16 mask = (1 << channels) - 1;
+    for (unsigned int nx = 0; nx < out_width; nx++, out += channels, weights += taps) {
+      const float *inp = in + (start[nx] * channels), *w = weights;
+      __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+      unsigned int j = taps;
+      for (; j >= 2; j -= 2, inp += 2 * channels, w += 2) {
+	acc0 = _mm512_fmadd_ps(_mm512_set1_ps(w[0]), _mm512_maskz_loadu_ps(mask, inp), acc0);
+	acc1 = _mm512_fmadd_ps(_mm512_set1_ps(w[1]), _mm512_maskz_loadu_ps(mask, inp + channels), acc1);
+      }
+      if (j)
+	acc0 = _mm512_fmadd_ps(_mm512_set1_ps(*w), _mm512_maskz_loadu_ps(mask, inp), acc0);
+      _mm512_mask_storeu_ps(out, mask, _mm512_add_ps(acc0, acc1));
+    }
+    return true;
+  }
+#endif
+
+  void SIMD::weighted_sum_rows(const float* const* rows, const float* weights, unsigned int taps, float* out, size_t n) {
+#ifdef HAZ_X86_SIMD
+    switch (level()) {
+    case SIMDLevel::AVX512:
+      weighted_sum_rows_avx512(rows, weights, taps, out, n);
+      return;
+
+    case SIMDLevel::AVX2:
+      weighted_sum_rows_avx2(rows, weights, taps, out, n);
+      return;
+
+    case SIMDLevel::SSE4_2:
+      weighted_sum_rows_sse(rows, weights, taps, out, n);
+      return;
+
+    default:
+      break;
+    }
+#endif
+    weighted_sum_rows_scalar(rows, weights, taps, out, 0, n);
+  }
+
+  void SIMD::convolve_row_h(const float* in, float* out, unsigned int out_width, unsigned int channels,
+			    const unsigned int* start, const float* weights, unsigned int taps) {
+#ifdef HAZ_X86_SIMD
+    switch (level()) {
+    case SIMDLevel::AVX512:
+      if (convolve_row_h_avx512(in, out, out_width, channels, start, weights, taps))
+	return;
+      break;
+
+    case SIMDLevel::AVX2:
+      if (convolve_row_h_avx2(in, out, out_width, channels, start, weights, taps))
+	return;
+      break;
+
+    case SIMDLevel::SSE4_2:
+      if (convolve_row_h_sse(in, out, out_width, channels, start, weights, taps))
+	return;
+      break;
+
+    default:
+      break;
+    }
+#endif
+    for (unsigned int nx = 0; nx < out_width; nx++, out += channels, weights += taps)
+      convolve_pixel_scalar(in + (start[nx] * channels), out, channels, taps, weights);
+  }
+
+}; // namespace PhotoFinish
@@ -194,7 +194,7 @@ namespace PhotoFinish {
     std::cerr << "Making EXIF thumbnail..." << std::endl;
 
     Frame frame(width, height, 0, 0, img->width(), img->height());
-    auto thumbimage = frame.crop_resize(img, D_resize::lanczos(3.0));
+    auto thumbimage = frame.crop_resize(img, D_resize::lanczos(3.0).set_prereduce(3));
 
     auto dest = std::make_shared<Destination>();
     dest->set_jpeg(D_JPEG(50, 1, 1, false));
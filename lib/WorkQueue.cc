@@ -0,0 +1,197 @@
+/*
+	Copyright 2014-2019 Ian Tester
+
+	This file is part of Photo Finish.
+
+	Photo Finish is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	Photo Finish is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <iostream>
+#include <thread>
+#include <omp.h>
+#include "WorkQueue.hh"
+#include "MemoryBudget.hh"
+
+namespace PhotoFinish {
+
+  Task::Task(const std::string& name, unsigned int priority, std::function<void(void)> f) :
+    _name(name),
+    _function(f),
+    _priority(priority), _sequence(0),
+    _waiting(0),
+    _failed(false),
+    _barrier(false),
+    _finished(false),
+    _memory(0),
+    _allocated(0)
+  {}
+
+  WorkQueue::WorkQueue(unsigned int workers) :
+    _num_workers(workers > 0 ? workers : 1),
+    _threads_per_worker(1),
+    _sequence(0), _remaining(0), _waiting_for_memory(0)
+  {
+    // Share the OpenMP threads out between the workers so they don't fight over cores
+    int threads = omp_get_max_threads() / _num_workers;
+    if (threads > 1)
+      _threads_per_worker = threads;
+
+    MemoryBudget::set_waker([this] {
+	std::lock_guard<std::mutex> lock(_lock);
+	_cond.notify_all();
+      });
+  }
+
+  WorkQueue::~WorkQueue() {
+    MemoryBudget::set_waiting(false);
+    MemoryBudget::set_waker(nullptr);
+  }
+
+  Task::ptr WorkQueue::add(const std::string& name, unsigned int priority, std::function<void(void)> f, const std::vector<Task::ptr>& deps, size_t memory) {
+    auto task = std::make_shared<Task>(name, priority, f);
+    task->_memory = memory;
+    _add(task, deps);
+    return task;
+  }
+
+  void WorkQueue::_add(Task::ptr task, const std::vector<Task::ptr>& deps) {
+    std::lock_guard<std::mutex> lock(_lock);
+    task->_sequence = _sequence++;
+    for (auto dep : deps)
+      if (dep && !dep->_finished) {
+	dep->_dependents.push_back(task);
+	task->_waiting++;
+      }
+
+    _remaining++;
+    if (task->_waiting == 0)
+      _ready.insert(task);
+  }
+
+  Task::ptr WorkQueue::add_barrier(const std::string& name, unsigned int priority, const std::vector<Task::ptr>& deps) {
+    return add_barrier(name, priority, nullptr, deps);
+  }
+
+  Task::ptr WorkQueue::add_barrier(const std::string& name, unsigned int priority, std::function<void(void)> f, const std::vector<Task::ptr>& deps) {
+    auto task = std::make_shared<Task>(name, priority, f);
+    // Set before any dependency can finish and mark it as failed
+    task->_barrier = true;
+    _add(task, deps);
+    return task;
+  }
+
+  void WorkQueue::add_dependency(Task::ptr task, Task::ptr dep) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (dep->_finished)
+      return;
+    dep->_dependents.push_back(task);
+    task->_waiting++;
+  }
+
+  void WorkQueue::_finish(Task::ptr task, bool failed) {
+    task->_finished = true;
+    for (auto dependent : task->_dependents) {
+      if (failed && !dependent->_barrier)
+	dependent->_failed = true;
+      if (--dependent->_waiting == 0)
+	_ready.insert(dependent);
+    }
+    task->_dependents.clear();
+    _remaining--;
+    _cond.notify_all();
+  }
+
+  size_t WorkQueue::_reserved(void) const {
+    // Allocations on other threads (e.g. OpenMP's) aren't counted, so the estimate is held on to for those
+    size_t reserved = 0;
+    for (auto task : _running) {
+      size_t allocated = task->_allocated.load(std::memory_order_relaxed);
+      if (allocated < task->_memory)
+	reserved += task->_memory - allocated;
+    }
+    return reserved;
+  }
+
+  Task::ptr WorkQueue::_admit(void) {
+    bool blocked = false;
+    for (auto task : _ready) {
+      if (task->_memory == 0)
+	return task;
+      if (!blocked && MemoryBudget::fits(task->_memory, _reserved()))
+	return task;
+      // Don't let later tasks that need memory take it first
+      blocked = true;
+    }
+
+    if (_running.empty())
+      return *_ready.begin();
+
+    return nullptr;
+  }
+
+  void WorkQueue::_worker(void) {
+    omp_set_num_threads(_threads_per_worker);
+
+    std::unique_lock<std::mutex> lock(_lock);
+    while (true) {
+      _cond.wait(lock, [this] { return !_ready.empty() || (_remaining == 0); });
+      if (_ready.empty())
+	break;
+
+      // Memory is also freed part-way through tasks, which wakes us up while we wait
+      if (_waiting_for_memory++ == 0)
+	MemoryBudget::set_waiting(true);
+      auto task = _admit();
+      if (!task)
+	_cond.wait(lock);
+      if (--_waiting_for_memory == 0)
+	MemoryBudget::set_waiting(false);
+      if (!task)
+	continue;
+
+      _ready.erase(task);
+      _running.insert(task);
+      lock.unlock();
+
+      bool failed = task->_failed;
+      if (failed)
+	std::cerr << "Skipping \"" << task->_name << "\"." << std::endl;
+      else if (task->_function) {
+	MemoryBudget::set_account(&task->_allocated);
+	try {
+	  task->_function();
+	} catch (std::exception& ex) {
+	  std::cout << ex.what() << std::endl;
+	  failed = true;
+	}
+	MemoryBudget::set_account(nullptr);
+      }
+      // Let go of anything the function was holding on to
+      task->_function = nullptr;
+
+      lock.lock();
+      _running.erase(task);
+      _finish(task, failed);
+    }
+  }
+
+  void WorkQueue::run(void) {
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < _num_workers; i++)
+      workers.push_back(std::thread(&WorkQueue::_worker, this));
+
+    for (auto& w : workers)
+      w.join();
+  }
+
+}; // namespace PhotoFinish
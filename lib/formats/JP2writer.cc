@@ -225,18 +225,20 @@ namespace PhotoFinish {
       }
     }
 
+    // Lazy images must make their rows before the parallel loop reads them
+    img->generate_all();
 #pragma omp parallel for schedule(dynamic, 1)
     for (unsigned int y = 0; y < img->height(); y++) {
       if (format.is_planar())
 	if (depth == 1)
-	  write_planar<unsigned char>(img->width(), channels, img->row(y)->data<unsigned char>(), jp2_image, y);
+	  write_planar<unsigned char>(img->width(), channels, img->row_data<unsigned char>(y), jp2_image, y);
 	else
-	  write_planar<short unsigned int>(img->width(), channels, img->row(y)->data<short unsigned int>(), jp2_image, y);
+	  write_planar<short unsigned int>(img->width(), channels, img->row_data<short unsigned int>(y), jp2_image, y);
       else
 	if (depth == 1)
-	  write_packed<unsigned char>(img->width(), channels, img->row(y)->data<unsigned char>(), jp2_image, y);
+	  write_packed<unsigned char>(img->width(), channels, img->row_data<unsigned char>(y), jp2_image, y);
 	else
-	  write_packed<short unsigned int>(img->width(), channels, img->row(y)->data<short unsigned int>(), jp2_image, y);
+	  write_packed<short unsigned int>(img->width(), channels, img->row_data<short unsigned int>(y), jp2_image, y);
 
       if (can_free)
 	img->free_row(y);
@@ -99,9 +99,11 @@ namespace PhotoFinish {
     size_t inbuffer_size = img->width() * img->height() * img->format().bytes_per_pixel();
     uint8_t *inbuffer = new uint8_t[inbuffer_size];
 
+    // Lazy images must make their rows before the parallel loop reads them
+    img->generate_all();
 #pragma omp parallel for schedule(dynamic, 1)
     for (uint32_t y = 0; y < info.ysize; y++)
-      memcpy(inbuffer + (y * img->row_size()), img->row(y)->data(), img->row_size());
+      memcpy(inbuffer + (y * img->row_size()), img->row_data(y), img->row_size());
 
     if (JxlEncoderAddImageFrame(encopts, &pixel_format, inbuffer, inbuffer_size) > 0)
       throw LibraryError("libjxl", "Could not add image frame");
@@ -16,6 +16,7 @@
 	You should have received a copy of the GNU General Public License
 	along with Photo Finish.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <mutex>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -33,20 +34,8 @@ namespace PhotoFinish {
 
 #define TIFFcheck(x) if ((rc = TIFF##x) != 1) throw LibraryError("libtiff", "TIFF" #x " returned " + rc)
 
-  Image::ptr TIFFreader::read(Destination::ptr dest) {
-    if (_is_open)
-      throw FileOpenError("already open");
-    _is_open = true;
-
-    std::cerr << "Opening file " << _filepath << "..." << std::endl;
-    fs::ifstream fb(_filepath, std::ios_base::in);
-    if (fb.fail())
-      throw FileOpenError(_filepath.native());
-
-    TIFF *tiff = TIFFStreamOpen("", &fb);
-    if (tiff == nullptr)
-      throw FileOpenError(_filepath.native());
-
+  //! Read the header of a TIFF file and make an empty image to hold its data
+  static Image::ptr read_header(TIFF *tiff, Destination::ptr dest) {
     int rc;
     uint32 width, height;
     TIFFcheck(GetField(tiff, TIFFTAG_IMAGEWIDTH, &width));
@@ -161,6 +150,27 @@ namespace PhotoFinish {
       }
     }
 
+    return img;
+  }
+
+  Image::ptr TIFFreader::read(Destination::ptr dest) {
+    if (_is_open)
+      throw FileOpenError("already open");
+    _is_open = true;
+
+    std::cerr << "Opening file " << _filepath << "..." << std::endl;
+    fs::ifstream fb(_filepath, std::ios_base::in);
+    if (fb.fail())
+      throw FileOpenError(_filepath.native());
+
+    TIFF *tiff = TIFFStreamOpen(_filepath.native().c_str(), &fb);
+    if (tiff == nullptr)
+      throw FileOpenError(_filepath.native());
+
+    auto img = read_header(tiff, dest);
+    unsigned int height = img->height();
+    int rc;
+
     std::cerr << "\tReading TIFF image..." << std::endl;
     for (unsigned int y = 0; y < height; y++) {
       img->check_row_alloc(y);
@@ -180,4 +190,85 @@ namespace PhotoFinish {
     return img;
   }
 
+  //! Reads the rows of a TIFF file as they are needed
+  class TIFFrowReader : public RowGenerator {
+  private:
+    fs::ifstream _fb;
+    TIFF *_tiff;
+    bool *_is_open;		// The reader's flag, until it goes away
+    std::mutex _reader_lock;
+
+  public:
+    TIFFrowReader(const fs::path filepath, bool* is_open) :
+      _fb(filepath, std::ios_base::in),
+      _tiff(nullptr),
+      _is_open(is_open)
+    {
+      if (_fb.fail())
+	throw FileOpenError(filepath.native());
+
+      _tiff = TIFFStreamOpen(filepath.native().c_str(), &_fb);
+      if (_tiff == nullptr)
+	throw FileOpenError(filepath.native());
+    }
+
+    ~TIFFrowReader() {
+      close();
+    }
+
+    inline TIFF* tiff(void) const { return _tiff; }
+
+    //! The reader is going away, so stop telling it when the file is closed
+    void detach(void) {
+      std::lock_guard<std::mutex> lock(_reader_lock);
+      _is_open = nullptr;
+    }
+
+    void close(void) {
+      if (_tiff != nullptr) {
+	TIFFClose(_tiff);
+	_tiff = nullptr;
+	_fb.close();
+
+	std::lock_guard<std::mutex> lock(_reader_lock);
+	if (_is_open != nullptr)
+	  *_is_open = false;
+      }
+    }
+
+    void generate(Image& dest, unsigned int first, unsigned int last) {
+      int rc;
+      for (unsigned int y = first; y < last; y++)
+	TIFFcheck(ReadScanline(_tiff, dest.write_row_data(y), y));
+
+      if (last == dest.height())
+	close();
+    }
+
+  }; // class TIFFrowReader
+
+  TIFFreader::~TIFFreader() {
+    auto rows = _rows.lock();
+    if (rows)
+      rows->detach();
+  }
+
+  Image::ptr TIFFreader::read_lazy(Destination::ptr dest) {
+    if (_is_open)
+      throw FileOpenError("already open");
+
+    std::cerr << "Opening file " << _filepath << "..." << std::endl;
+    auto rows = std::make_shared<TIFFrowReader>(_filepath, &_is_open);
+    _is_open = true;
+    _rows = rows;
+    auto img = read_header(rows->tiff(), dest);
+
+    std::cerr << "\tExtracting tags..." << std::endl;
+    extract_tags(img);
+
+    std::cerr << "\tReading TIFF image as rows are needed." << std::endl;
+    img->set_generator(rows);
+    return img;
+  }
+
 }
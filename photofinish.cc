@@ -19,6 +19,11 @@
 #include <iostream>
 #include <string>
 #include <deque>
+#include <map>
+#include <sstream>
+#include <atomic>
+#include <functional>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -27,17 +32,106 @@
 #include "ImageFile.hh"
 #include "Destination.hh"
 #include "Tags.hh"
+#include "Kernel1Dvar.hh"
 #include "Kernel2D.hh"
 #include "Exception.hh"
 #include "Benchmark.hh"
+#include "WorkQueue.hh"
+#include "MemoryBudget.hh"
+#include "SIMD.hh"
 
 namespace fs = boost::filesystem;
 
 using namespace PhotoFinish;
 
+// State shared by the tasks working on one input file
+struct FileJob {
+  ImageReader::ptr infile;
+  Tags::ptr tags;
+  bool streaming;
+  Image::ptr image;
+  Task::ptr lab;		// Until the decode task has estimated its memory
+};
+
+// An intermediate image that one or more destinations of a file share
+struct Stage {
+  std::shared_ptr<Stage> parent;
+  std::function<Image::ptr(Image::ptr, bool, bool)> work;
+  Image::ptr image;
+  bool can_free;		// Can whatever uses the image free its rows?
+  unsigned int users;		// Number of stages or destinations using the image
+  std::atomic<unsigned int> pending;	// Users that have not finished with it yet
+  size_t memory;		// Estimate of the memory the image will use
+  bool lazy;			// Make rows only as they are needed
+  Frame::ptr frame;		// For resize stages, so that they can be done together
+  D_resize resize;
+  D_sharpen sharpen;		// For sharpen stages, so that they can be done with the resize
+  bool fused;			// Sharpening was done by the parent resize stage
+  Task::ptr task;
+
+  Stage() : can_free(false), users(0), pending(0), memory(0), lazy(false), fused(false) {}
+
+  typedef std::shared_ptr<Stage> ptr;
+};
+
+// Find the stage for a key, or make a new one that uses the parent stage
+Stage::ptr find_stage(std::map<std::string, Stage::ptr>& stages, std::vector<Stage::ptr>& order, const std::string& key, Stage::ptr parent, bool& is_new) {
+  auto si = stages.find(key);
+  if (si != stages.end()) {
+    is_new = false;
+    return si->second;
+  }
+
+  auto stage = std::make_shared<Stage>();
+  stage->parent = parent;
+  if (parent)
+    parent->users++;
+  stages[key] = stage;
+  order.push_back(stage);
+  is_new = true;
+  return stage;
+}
+
+// Let go of the image of a stage once everything using it is finished
+void release_stage(Stage::ptr stage) {
+  if (stage && (--stage->pending == 0))
+    stage->image.reset();
+}
+
+// State shared by the tasks working on one destination of an input file
+struct DestJob {
+  std::string name;
+  Destination::ptr destination;
+  Tags::ptr tags;
+  ImageWriter::ptr outfile;
+  bool thumbnail;
+  Stage::ptr final;
+};
+
+// Estimate the memory used by an image
+size_t image_memory(double width, double height, size_t pixel_size) {
+  return (size_t)ceil(width) * (size_t)ceil(height) * pixel_size;
+}
+
+// Estimate the memory of a decoded image from the dimensions in its header.
+// The bit depth isn't known yet, so assume 8-bit CMYK for JPEG and 16-bit
+// RGBA for everything else. Without dimensions, assume 20 times the file size.
+size_t decoded_memory(const fs::path& filepath) {
+  try {
+    Exiv2::Image::AutoPtr imagefile = Exiv2::ImageFactory::open(filepath.native());
+    imagefile->readMetadata();
+    if ((imagefile->pixelWidth() > 0) && (imagefile->pixelHeight() > 0))
+      return image_memory(imagefile->pixelWidth(), imagefile->pixelHeight(), imagefile->mimeType() == "image/jpeg" ? 4 : 8);
+  } catch (std::exception& ex) {
+    // Fall back on the file size
+  }
+
+  return fs::file_size(filepath) * 20;
+}
+
 int main(int argc, char* argv[]) {
   if (argc == 1) {
-    std::cerr << argv[0] << "<input file> [<input file>...] <destination> [<destination>...]" << std::endl;
+    std::cerr << argv[0] << " [-b] [-j <workers>] [--max-memory <size>] [--disk-backed] [--disk-threshold <size>] [--intermediate float|half|16bit] [--simd scalar|sse4.2|avx2|avx512] [--kernel-quantum <pixels>] [--transform-cache <dir>] <input file> [<input file>...] <destination> [<destination>...]" << std::endl;
     exit(1);
   }
 
@@ -47,11 +141,66 @@ int main(int argc, char* argv[]) {
 
   std::deque<std::string> arg_destinations;
   std::deque<fs::path> arg_filenames;
+  unsigned int num_workers = 1;
   for (int i = 1; i < argc; i++) {
     if (std::string(argv[i]) == "-b") {
       benchmark_mode = true;
       continue;
     }
+    if ((std::string(argv[i]) == "-j") && (i + 1 < argc)) {
+      num_workers = atoi(argv[++i]);
+      continue;
+    }
+    if ((std::string(argv[i]) == "--max-memory") && (i + 1 < argc)) {
+      uint64_t bytes;
+      if (!parse_byte_size(argv[++i], bytes)) {
+	std::cerr << "Could not understand memory size \"" << argv[i] << "\"." << std::endl;
+	exit(1);
+      }
+      MemoryBudget::set_limit(bytes);
+      continue;
+    }
+    if ((std::string(argv[i]) == "--disk-threshold") && (i + 1 < argc)) {
+      uint64_t bytes;
+      if (!parse_byte_size(argv[++i], bytes)) {
+	std::cerr << "Could not understand memory size \"" << argv[i] << "\"." << std::endl;
+	exit(1);
+      }
+      ImageSlab::file_threshold = bytes;
+      continue;
+    }
+    if ((std::string(argv[i]) == "--intermediate") && (i + 1 < argc)) {
+      if (!parse_precision(argv[++i], Image::intermediate_precision)) {
+	std::cerr << "Unknown intermediate precision \"" << argv[i] << "\"." << std::endl;
+	exit(1);
+      }
+      continue;
+    }
+    if ((std::string(argv[i]) == "--simd") && (i + 1 < argc)) {
+      SIMDLevel level;
+      if (!SIMD::parse_level(argv[++i], level)) {
+	std::cerr << "Unknown SIMD level \"" << argv[i] << "\"." << std::endl;
+	exit(1);
+      }
+      SIMD::set_level(level);
+      continue;
+    }
+    if ((std::string(argv[i]) == "--kernel-quantum") && (i + 1 < argc)) {
+      Kernel1Dvar::cache_quantum = atof(argv[++i]);
+      continue;
+    }
+    if ((std::string(argv[i]) == "--transform-cache") && (i + 1 < argc)) {
+      CMS::Transform::disk_cache_dir = argv[++i];
+      continue;
+    }
+    if (std::string(argv[i]) == "--disk-backed") {
+      ImageSlab::use_files = true;
+      continue;
+    }
+    if (std::string(argv[i]) == "--huge-pages") {
+      ImageSlab::use_huge_pages = true;
+      continue;
+    }
 
     struct stat s;
     if (destinations.count(argv[i]))
@@ -67,59 +216,99 @@ int main(int argc, char* argv[]) {
   if (fs::exists(".tags/default"))
     defaulttags->load(".tags/default");
 
+  // A bounded number of files are in flight at once, and a file's tasks are
+  // preferred over those of later files, so one worker behaves like a simple loop.
+  WorkQueue queue(num_workers);
+  unsigned int max_files = queue.num_workers() + 1;
+  std::vector<Task::ptr> files_done;
+
   for (auto fi : arg_filenames) {
+    unsigned int file_num = files_done.size();
+    auto job = std::make_shared<FileJob>();
     try {
       ImageFilepath infilepath(fi);
-      auto infile = ImageReader::open(infilepath);
-      auto tags = defaulttags->dupe();
+      job->infile = ImageReader::open(infilepath);
+      job->tags = defaulttags->dupe();
       {
 	fs::path tagpath = fi.parent_path() / ("." + fi.stem().native() + ".tags");
 	if (fs::exists(tagpath))
-	  tags->load(tagpath);
+	  job->tags->load(tagpath);
       }
+    } catch (std::exception& ex) {
+      std::cout << ex.what() << std::endl;
+      continue;
+    }
 
-      try {
-	auto orig_image = infile->read();
-	{
-	  CMS::Format internal_format;
-	  internal_format.set_colour_model(CMS::ColourModel::Lab);
-	  SET_SAMPLE_FORMAT(internal_format);
-	  internal_format.set_extra_channels(orig_image->format().extra_channels());
-	  orig_image = orig_image->transform_colour(CMS::Profile::Lab4(), internal_format);
-	}
+    // With only one destination and no thumbnail, every stage can pass rows
+    // along as soon as they are made instead of holding whole images.
+    job->streaming = false;
+    if (arg_destinations.size() == 1) {
+      auto destination = destinations[arg_destinations.front()]->add_variables(job->tags->variables());
+      job->streaming = !(destination->thumbnail().defined() && destination->thumbnail().generate().defined() && destination->thumbnail().generate());
+    }
 
-	auto num_destinations = arg_destinations.size();
-	for (auto& di : arg_destinations) {
-	  bool last_dest = (num_destinations == 1);
-	  auto destination = destinations[di]->add_variables(tags->variables());
-	  try {
-	    definable<double> size = destination->size();
+    std::vector<Task::ptr> decode_deps;
+    if (file_num >= max_files)
+      decode_deps.push_back(files_done[file_num - max_files]);
+
+    auto decode = queue.add("decode " + fi.native(), file_num, [job] {
+	job->image = job->streaming ? job->infile->read_lazy() : job->infile->read();
+	job->infile.reset();
+	if (!job->streaming)
+	  job->lab->set_memory(image_memory(job->image->width(), job->image->height(), Image::intermediate_format(job->image->format().extra_channels()).bytes_per_pixel()));
+	job->lab.reset();
+      }, decode_deps, job->streaming ? 0 : decoded_memory(fi));
+
+    auto lab = queue.add("Lab transform " + fi.native(), file_num, [job] {
+	CMS::Format internal_format = Image::intermediate_format(job->image->format().extra_channels());
+	if (job->streaming)
+	  job->image = job->image->transform_colour_lazy(CMS::Profile::Lab4(), internal_format);
+	else
+	  job->image = job->image->transform_colour(CMS::Profile::Lab4(), internal_format);
+      }, { decode });
+    job->lab = lab;
+
+    std::vector<std::shared_ptr<DestJob>> dests;
+    for (auto& di : arg_destinations) {
+      auto dj = std::make_shared<DestJob>();
+      dj->name = di;
+      dj->tags = job->tags->dupe();
+      dj->destination = destinations[di]->add_variables(dj->tags->variables());
+      dests.push_back(dj);
+    }
+
+    auto finish = std::make_shared<Task::ptr>();
+    // Once the image dimensions and format are known, work out what each
+    // destination needs and only add a task for each distinct piece of work.
+    // Destinations that only differ in e.g. output format or quality share
+    // the same resized and sharpened images, and maybe the transformed one.
+    auto plan = queue.add("plan " + fi.native(), file_num, [&queue, fi, file_num, job, dests, finish] {
+	std::map<std::string, Stage::ptr> resized, sharpened, transformed;
+	std::vector<Stage::ptr> resize_order, sharpen_order, transform_order;
+
+	// A destination that can't be planned is skipped, the others carry on
+	std::vector<std::shared_ptr<DestJob>> planned;
+	for (auto dj : dests) {
+	  auto destination = dj->destination;
+	  std::ostringstream key, dest_key;
+	  key.precision(17);
+	  definable<double> size = destination->size();
+	  Frame::ptr frame;
+	  CMS::Format dest_format;
+	  bool thumbnail;
 
-	    Image::ptr sized_image;
+	  // Everything that can fail is done before any stage is added
+	  try {
 	    if (destination->noresize().defined() && destination->noresize()) {
-	      sized_image = orig_image;
+	      key << "noresize";
 	    } else {
-	      auto frame = destination->best_frame(orig_image);
-	      sized_image = frame->crop_resize(orig_image, destination->resize(), last_dest);
+	      frame = destination->best_frame(job->image);
 	      if (frame->size().defined())
 		size = frame->size();
+	      key << "frame(" << frame->crop_x() << ", " << frame->crop_y() << ", " << frame->crop_w() << ", " << frame->crop_h()
+		  << " => " << frame->width() << "x" << frame->height() << ") " << destination->resize();
 	    }
-
-	    Image::ptr sharp_image;
-	    if (destination->sharpen().defined()) {
-	      auto sharpen = Kernel2D::create(destination->sharpen());
-	      sharp_image = sharpen->convolve(sized_image, (sized_image != orig_image) || last_dest);
-	    } else
-	      sharp_image = sized_image;
-	    sized_image.reset();	// Unallocate resized image
-
-	    if (size.defined()) {
-	      sharp_image->set_resolution_from_size(size);
-	      tags->add_resolution(sharp_image);
-	    }
-
-	    if (destination->thumbnail().defined() && destination->thumbnail().generate().defined() && destination->thumbnail().generate())
-	      tags->make_thumbnail(sharp_image, destination->thumbnail());
+	    key << " size=" << size;
 
 	    if (!exists(destination->dir())) {
 	      std::cerr << "Creating directory " << destination->dir() << "." << std::endl;
@@ -130,29 +319,256 @@ int main(int argc, char* argv[]) {
 	    if (destination->format().length() > 0)
 	      format = destination->format();
 	    ImageFilepath outfilepath(destination->dir() / fi.stem(), format);
-	    auto outfile = ImageWriter::open(outfilepath);
+	    dj->outfile = ImageWriter::open(outfilepath);
+	    dj->outfile->defer_tags();
 
-	    CMS::Format dest_format = outfile->preferred_format(destination->modify_format(sharp_image->format()));
-	    CMS::Profile::ptr dest_profile = destination->get_profile(dest_format.colour_model(), "destination");
-	    sharp_image = sharp_image->transform_colour(dest_profile, dest_format);
+	    dest_format = dj->outfile->preferred_format(destination->modify_format(job->image->format()));
+	    if (destination->profile()) {
+	      if (destination->profile()->has_data())
+		dest_key << " profile(" << destination->profile()->name() << ", " << (void*)destination->profile()->data() << ")";
+	      else
+		dest_key << " profile(" << destination->profile()->name() << ", " << destination->profile()->filepath() << ")";
+	    } else
+	      dest_key << " profile(default " << dest_format.colour_model() << ")";
+	    dest_key << " format=" << std::hex << (cmsUInt32Number)dest_format << std::dec << (dest_format.is_premult_alpha() ? " premult" : "");
 
-	    tags->copy_to(sharp_image);
-	    outfile->write(sharp_image, destination, (sharp_image != orig_image) || last_dest);
-	  } catch (DestinationError& ex) {
+	    dj->thumbnail = destination->thumbnail().defined() && destination->thumbnail().generate().defined() && destination->thumbnail().generate();
+	    thumbnail = dj->thumbnail;
+	    if (thumbnail)
+	      dest_key << " thumbnail(" << destination->thumbnail().maxwidth() << "x" << destination->thumbnail().maxheight() << ")";
+	  } catch (std::exception& ex) {
 	    std::cout << ex.what() << std::endl;
 	    continue;
 	  }
 
-	  num_destinations--;
+	  size_t pixel_size = job->image->format().bytes_per_pixel();
+	  double width = frame ? (double)frame->width() : job->image->width();
+	  double height = frame ? (double)frame->height() : job->image->height();
+
+	  bool is_new;
+	  auto resize = find_stage(resized, resize_order, key.str(), nullptr, is_new);
+	  if (is_new) {
+	    if (frame) {
+	      resize->memory = image_memory(width, height, pixel_size);
+	      resize->frame = frame;
+	      resize->resize = destination->resize();
+	    }
+	    resize->work = [frame, destination](Image::ptr image, bool can_free, bool lazy) {
+	      if (!frame)
+		return image;
+	      if (lazy || image->is_lazy())
+		return frame->crop_resize_lazy(image, destination->resize(), can_free);
+	      return frame->crop_resize(image, destination->resize(), can_free);
+	    };
+	  }
+
+	  if (destination->sharpen().defined())
+	    key << " " << destination->sharpen();
+
+	  auto sharpen = find_stage(sharpened, sharpen_order, key.str(), resize, is_new);
+	  if (is_new) {
+	    if (destination->sharpen().defined()) {
+	      sharpen->memory = image_memory(width, height, pixel_size)
+		+ Kernel2D::create(destination->sharpen())->extra_memory(width, height, job->image->format());
+	      sharpen->sharpen = destination->sharpen();
+	    }
+	    Stage *stage = sharpen.get();
+	    sharpen->work = [destination, size, stage](Image::ptr image, bool can_free, bool lazy) {
+	      if (destination->sharpen().defined() && !stage->fused) {
+		// Images made as their rows are needed can't use a kernel that needs the whole image
+		auto sharpen = Kernel2D::create(destination->sharpen(), lazy || image->is_lazy());
+		if (image->is_lazy())
+		  image = sharpen->convolve_lazy(image);
+		else
+		  image = sharpen->convolve(image, can_free);
+	      }
+	      if (size.defined())
+		image->set_resolution_from_size(size);
+	      return image;
+	    };
+	  }
+
+	  key << dest_key.str();
+	  dj->final = find_stage(transformed, transform_order, key.str(), sharpen, is_new);
+	  if (is_new) {
+	    // The tags of the first destination to need this image go with it
+	    auto tags = dj->tags;
+	    dj->final->memory = image_memory(width, height, dest_format.bytes_per_pixel());
+	    dj->final->work = [destination, tags, size, thumbnail, dest_format](Image::ptr image, bool can_free, bool lazy) {
+	      if (size.defined())
+		tags->add_resolution(image);
+
+	      if (thumbnail)
+		tags->make_thumbnail(image, destination->thumbnail());
+
+	      CMS::Profile::ptr dest_profile = destination->get_profile(dest_format.colour_model(), "destination");
+	      if (image->is_lazy())
+		image = image->transform_colour_lazy(dest_profile, dest_format);
+	      else
+		image = image->transform_colour(dest_profile, dest_format, CMS::Intent::Perceptual, can_free);
+
+	      tags->copy_to(image);
+	      return image;
+	    };
+	  } else
+	    std::cerr << "Destination \"" << dj->name << "\" shares its image with an earlier one." << std::endl;
+	  dj->final->users++;
+	  planned.push_back(dj);
 	}
-      } catch (std::exception& ex) {
-	std::cout << ex.what() << std::endl;
-      }
-    } catch (std::exception& ex) {
-      std::cout << ex.what() << std::endl;
-      continue;
-    }
 
+	// If a destination's images won't fit in the memory budget, and it
+	// doesn't share them with another destination, fall back to making its
+	// rows only as they are written. The source image is kept whole.
+	bool any_lazy = false;
+	if (MemoryBudget::limit() > 0)
+	  for (auto dj : planned) {
+	    auto sharpen = dj->final->parent;
+	    auto resize = sharpen->parent;
+	    if (dj->thumbnail || (resize->memory == 0)
+		|| (dj->final->users > 1) || (sharpen->users > 1) || (resize->users > 1))
+	      continue;
+
+	    size_t memory = resize->memory + sharpen->memory + dj->final->memory;
+	    if (MemoryBudget::fits(memory))
+	      continue;
+
+	    std::cerr << "The images for destination \"" << dj->name << "\" would need " << format_byte_size(memory)
+		      << ", more than the memory budget allows, so making its rows as they are needed." << std::endl;
+	    resize->lazy = sharpen->lazy = dj->final->lazy = true;
+	    any_lazy = true;
+	  }
+
+	// Resizes of whole images are done together, so that the source is read once
+	std::vector<Stage::ptr> together, one_by_one;
+	for (auto stage : resize_order)
+	  if (stage->frame && !stage->lazy && !job->streaming)
+	    together.push_back(stage);
+	  else
+	    one_by_one.push_back(stage);
+	if (together.size() < 2) {
+	  together.clear();
+	  one_by_one = resize_order;
+	}
+
+	// A resize used only by one sharpening stage sharpens its rows as it
+	// makes them, so the whole resized image is never kept
+	for (auto stage : sharpen_order) {
+	  auto resize = stage->parent;
+	  if (!stage->sharpen.defined() || stage->lazy || job->streaming || !resize->frame || (resize->users > 1)
+	      || (std::find(one_by_one.begin(), one_by_one.end(), resize) == one_by_one.end())
+	      || !Kernel2D::create(stage->sharpen)->is_windowed())
+	    continue;
+
+	  auto frame = resize->frame;
+	  auto dr = resize->resize;
+	  auto ds = stage->sharpen;
+	  resize->work = [frame, dr, ds](Image::ptr image, bool can_free, bool lazy) {
+	    return frame->crop_resize_sharpen(image, dr, Kernel2D::create(ds), can_free);
+	  };
+	  stage->fused = true;
+	  stage->memory = 0;
+	}
+
+	// A destination that isn't resized uses the source image itself, so its rows must be kept
+	bool pass_through = false;
+	for (auto stage : resize_order)
+	  if (!stage->frame)
+	    pass_through = true;
+
+	// Resizes of one file don't wait for each other, so only a lone resize
+	// may free the source rows as it goes. Otherwise the source is let go
+	// once they have all finished, even if some of them failed.
+	unsigned int num_resizes = one_by_one.size() + (together.size() > 0 ? 1 : 0);
+	bool can_free = (num_resizes == 1) && !any_lazy && !pass_through;
+	std::vector<Task::ptr> resize_tasks;
+	if (together.size() > 0) {
+	  size_t memory = 0;
+	  for (auto stage : together) {
+	    stage->pending = stage->users;
+	    // The horizontally resized images are kept until the vertical passes
+	    memory += stage->memory + image_memory(stage->frame->width(), job->image->height(), job->image->format().bytes_per_pixel());
+	  }
+	  auto task = queue.add("resize " + fi.native() + " to " + std::to_string(together.size()) + " sizes", file_num, [job, together, can_free] {
+	      std::vector<Frame::ptr> frames;
+	      std::vector<D_resize> resizes;
+	      for (auto stage : together) {
+		frames.push_back(stage->frame);
+		resizes.push_back(stage->resize);
+	      }
+	      auto images = Frame::crop_resize_many(job->image, frames, resizes, can_free);
+	      for (unsigned int i = 0; i < together.size(); i++) {
+		auto stage = together[i];
+		stage->image = images[i];
+		stage->can_free = (stage->users == 1);
+		stage->work = nullptr;
+	      }
+	    }, { }, memory);
+	  for (auto stage : together)
+	    stage->task = task;
+	  resize_tasks.push_back(task);
+	}
+
+	for (auto stage : one_by_one) {
+	  stage->pending = stage->users;
+	  stage->task = queue.add("resize " + fi.native(), file_num, [job, stage, can_free] {
+	      stage->image = stage->work(job->image, can_free, stage->lazy);
+	      stage->can_free = (stage->users == 1) && ((stage->image != job->image) || can_free);
+	      stage->work = nullptr;
+	    }, { }, stage->lazy ? 0 : stage->memory);
+	  resize_tasks.push_back(stage->task);
+	}
+
+	auto release = queue.add_barrier("release source " + fi.native(), file_num, [job] {
+	    job->image.reset();
+	  }, resize_tasks);
+	queue.add_dependency(*finish, release);
+
+	for (auto order : { &sharpen_order, &transform_order })
+	  for (auto stage : *order) {
+	    stage->pending = stage->users;
+	    stage->task = queue.add((order == &sharpen_order ? "sharpen " : "destination transform ") + fi.native(), file_num, [stage] {
+		auto parent = stage->parent;
+		stage->image = stage->work(parent->image, parent->can_free, stage->lazy);
+		// A stage that did nothing passes on the parent's right to free rows
+		stage->can_free = (stage->users == 1) && ((stage->image != parent->image) || parent->can_free);
+		stage->work = nullptr;
+	      }, { stage->parent->task }, stage->lazy ? 0 : stage->memory);
+
+	    // Let go of the parent's image even if this stage fails
+	    auto parent = stage->parent;
+	    auto release_parent = queue.add_barrier("release " + fi.native(), file_num, [parent] {
+		release_stage(parent);
+	      }, { stage->task });
+	    queue.add_dependency(*finish, release_parent);
+	  }
+
+	for (auto dj : planned) {
+	  auto stage = dj->final;
+	  auto encode = queue.add("encode " + fi.native() + " for " + dj->name, file_num, [dj, stage] {
+	      dj->outfile->write(stage->image, dj->destination, stage->can_free);
+	    }, { stage->task });
+
+	  auto tags = queue.add("embed tags " + fi.native() + " for " + dj->name, file_num, [dj, stage] {
+	      dj->outfile->embed_deferred_tags(stage->image);
+	    }, { encode });
+
+	  auto release_final = queue.add_barrier("release " + fi.native() + " for " + dj->name, file_num, [stage] {
+	      release_stage(stage);
+	    }, { tags });
+	  queue.add_dependency(*finish, release_final);
+	}
+      }, { lab });
+
+    *finish = queue.add_barrier("finish " + fi.native(), file_num, { lab, plan });
+    files_done.push_back(*finish);
+  }
+
+  queue.run();
+
+  if (benchmark_mode) {
+    std::cerr << "Benchmark: Kernel cache had " << Kernel1Dvar::cache_hits() << " hits and " << Kernel1Dvar::cache_misses() << " misses." << std::endl;
+    std::cerr << "Benchmark: Colour transform cache had " << CMS::Transform::cache_hits() << " hits and " << CMS::Transform::cache_misses() << " misses ("
+	      << CMS::Transform::disk_hits() << " loaded from disk)." << std::endl;
   }
 
   return 0;
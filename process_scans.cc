@@ -35,9 +35,11 @@
 #include "ImageFile.hh"
 #include "Destination.hh"
 #include "Tags.hh"
+#include "Kernel1Dvar.hh"
 #include "Kernel2D.hh"
 #include "Exception.hh"
 #include "Benchmark.hh"
+#include "SIMD.hh"
 
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
@@ -47,12 +49,8 @@ using namespace PhotoFinish;
 void make_preview(Image::ptr orig_image, Destination::ptr orig_dest, Tags::ptr filetags, ImageWriter::ptr preview_file, bool can_free = false) {
   CMS::ColourModel orig_model = orig_image->format().colour_model();
 
-  {
-    CMS::Format internal_format;
-    internal_format.set_colour_model(CMS::ColourModel::Lab);
-    SET_SAMPLE_FORMAT(internal_format);
-    orig_image = orig_image->transform_colour(CMS::Profile::Lab4(), internal_format);
-  }
+  // Previews don't need floating point, so by default they are resized as 16-bit Lab with integers, halving with a box filter first
+  orig_image = orig_image->transform_colour(CMS::Profile::Lab4(), Image::intermediate_format(0));
 
   auto resized_dest = orig_dest->dupe();
 
@@ -76,7 +74,7 @@ void make_preview(Image::ptr orig_image, Destination::ptr orig_dest, Tags::ptr f
 				       0, 0,
 				       orig_image->width(), orig_image->height());
 
-  auto resized_image = frame->crop_resize(orig_image, D_resize::lanczos(3));
+  auto resized_image = frame->crop_resize(orig_image, D_resize::lanczos(3).set_integer().set_prereduce(3));
 
   CMS::Format resized_format = resized_image->format();
   resized_format.set_colour_model(orig_model);
@@ -124,7 +122,7 @@ int main(int argc, char* argv[]) {
   // Variables that are to be loaded from the config file and command line
   bool do_conversion, do_preview, do_move_originals;
   fs::path convert_dir, works_dir;
-  std::string convert_format, preview_format;
+  std::string convert_format, preview_format, disk_threshold, intermediate, simd;
   typedef std::vector<fs::path> pathlist;
   pathlist include_paths;
 
@@ -138,6 +136,12 @@ int main(int argc, char* argv[]) {
       ("preview,P", po::bool_switch(&do_preview), "Scale the image to a preview")
       ("move-originals,M", po::bool_switch(&do_move_originals), "Move originals (done automatically when converting)")
       ("benchmark,b", po::bool_switch(&benchmark_mode), "Show performance information after certain operations")
+      ("huge-pages", po::bool_switch(&ImageSlab::use_huge_pages), "Back image data with transparent huge pages")
+      ("disk-backed", po::bool_switch(&ImageSlab::use_files), "Back all image data with temporary files")
+      ("disk-threshold", po::value<std::string>(&disk_threshold), "Back images at least this big (e.g. 4G) with temporary files")
+      ("intermediate", po::value<std::string>(&intermediate)->default_value("16bit"), "Precision of intermediate images: float, half, or 16bit")
+      ("simd", po::value<std::string>(&simd), "Highest SIMD level to use: scalar, sse4.2, avx2, or avx512")
+      ("transform-cache", po::value<fs::path>(&CMS::Transform::disk_cache_dir), "Directory to keep integer colour transforms in between runs, e.g. ~/.cache/PhotoFinish")
       ;
 
     po::options_description config_options("Configuration");
@@ -174,6 +178,29 @@ int main(int argc, char* argv[]) {
       std::cerr << visible_options << std::endl;
       exit(1);
     }
+
+    if (disk_threshold.length() > 0) {
+      uint64_t bytes;
+      if (!parse_byte_size(disk_threshold, bytes)) {
+	std::cerr << "Could not understand memory size \"" << disk_threshold << "\"." << std::endl;
+	exit(1);
+      }
+      ImageSlab::file_threshold = bytes;
+    }
+
+    if ((intermediate.length() > 0) && !parse_precision(intermediate, Image::intermediate_precision)) {
+      std::cerr << "Unknown intermediate precision \"" << intermediate << "\"." << std::endl;
+      exit(1);
+    }
+
+    if (simd.length() > 0) {
+      SIMDLevel level;
+      if (!SIMD::parse_level(simd, level)) {
+	std::cerr << "Unknown SIMD level \"" << simd << "\"." << std::endl;
+	exit(1);
+      }
+      SIMD::set_level(level);
+    }
   }
 
   lcms2_error_adaptor();
@@ -287,4 +314,10 @@ int main(int argc, char* argv[]) {
       create_directory(works_dir);
     }
   }
+
+  if (benchmark_mode) {
+    std::cerr << "Benchmark: Kernel cache had " << Kernel1Dvar::cache_hits() << " hits and " << Kernel1Dvar::cache_misses() << " misses." << std::endl;
+    std::cerr << "Benchmark: Colour transform cache had " << CMS::Transform::cache_hits() << " hits and " << CMS::Transform::cache_misses() << " misses ("
+	      << CMS::Transform::disk_hits() << " loaded from disk)." << std::endl;
+  }
 }